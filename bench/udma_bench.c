@@ -0,0 +1,526 @@
+/*
+ * udma_bench -- throughput and latency benchmark for the udma data path.
+ *
+ * Drives a udma-enabled uio device with blocking transfers (depth 1) or
+ * with UDMA_IOC_SUBMIT/UDMA_IOC_REAP keeping depth transfers in flight,
+ * from plain or registered buffers, one way or both at once, and reports
+ * MB/s, transfers/s, latency percentiles and CPU use.  --csv and --json
+ * give one line per direction for scripts (see udma_sweep.sh).
+ *
+ * Build:  cc -O2 -Wall -pthread -I.. -o udma_bench udma_bench.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+
+#include "udma_ioctl.h"
+
+#define PAGE_BYTES  (4096)
+
+enum bench_mode { MODE_TX, MODE_RX, MODE_DUPLEX };
+enum bench_fmt { FMT_TEXT, FMT_CSV, FMT_JSON };
+
+struct bench_opts {
+    const char *    dev;
+    enum bench_mode mode;
+    size_t          size;       // bytes per transfer
+    unsigned int    depth;      // transfers in flight, 1: blocking UDMA_IOC_XFER
+    size_t          offset;     // of each transfer from a page boundary
+    bool            reg;        // UDMA_IOC_REGISTER the buffer up front
+    double          seconds;
+    unsigned long   count;      // stop after this many transfers per direction, 0: run for seconds
+    int             rx_chan;    // UDMA_CHAN_NONE: the file's default
+    int             tx_chan;
+    enum bench_fmt  fmt;
+    bool            header;     // --csv: print the column names first
+};
+
+// One direction's worth of benchmark, run on its own file and thread.
+struct bench_dir {
+    const struct bench_opts * o;
+    uint32_t        dir;
+    int             fd;
+    char *          mem;        // what was allocated
+    char *          buf;        // depth slots of stride bytes, each at o->offset
+    size_t          stride;
+    uint32_t        handle;     // when o->reg
+
+    uint64_t *      lat_ns;
+    size_t          num_lat;
+    size_t          max_lat;
+    uint64_t        bytes;
+    uint64_t        xfers;
+    uint64_t        errors;
+    double          elapsed;
+    int             err;        // errno that stopped the run, 0 if none
+};
+
+static uint64_t now_ns( void )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void record( struct bench_dir * d, uint64_t lat, int64_t result )
+{
+    if ( result < 0 )
+    {
+        d->errors++;
+        return;
+    }
+
+    d->xfers++;
+    d->bytes += result;
+
+    if ( d->num_lat == d->max_lat )
+    {
+        size_t max = d->max_lat ? 2 * d->max_lat : 65536;
+        uint64_t * p = realloc( d->lat_ns, max * sizeof(*p) );
+
+        if ( !p )
+            return;     // keep counting, just stop sampling
+        d->lat_ns = p;
+        d->max_lat = max;
+    }
+    d->lat_ns[d->num_lat++] = lat;
+}
+
+static void fill_xfer( struct bench_dir * d, unsigned int slot, struct udma_xfer * x )
+{
+    memset( x, 0, sizeof(*x) );
+    x->len = d->o->size;
+    x->dir = d->dir;
+    x->user_data = slot;
+
+    if ( d->o->reg )
+    {
+        x->handle = d->handle;
+        x->offset = (d->buf - d->mem) + slot * d->stride;
+    }
+    else
+        x->addr = (uintptr_t)(d->buf + slot * d->stride);
+}
+
+static bool done( struct bench_dir * d, uint64_t start, unsigned long issued )
+{
+    if ( d->o->count )
+        return issued >= d->o->count;
+    return now_ns() - start >= (uint64_t)(d->o->seconds * 1e9);
+}
+
+static int run_blocking( struct bench_dir * d, uint64_t start )
+{
+    struct udma_xfer x;
+    unsigned long issued = 0;
+
+    fill_xfer( d, 0, &x );
+
+    while ( !done( d, start, issued ) )
+    {
+        uint64_t t0 = now_ns();
+        long rv = ioctl( d->fd, UDMA_IOC_XFER, &x );
+
+        record( d, now_ns() - t0, rv < 0 ? -errno : rv );
+        issued++;
+        if ( rv < 0 && EINTR != errno && EIO != errno )
+            return errno;
+    }
+
+    return 0;
+}
+
+static int run_queued( struct bench_dir * d, uint64_t start )
+{
+    const unsigned int depth = d->o->depth;
+    struct udma_completion * comp = calloc( depth, sizeof(*comp) );
+    uint64_t * t_submit = calloc( depth, sizeof(*t_submit) );
+    unsigned long issued = 0;
+    unsigned int inflight = 0, i;
+    int err = 0;
+
+    if ( !comp || !t_submit )
+    {
+        err = ENOMEM;
+        goto out;
+    }
+
+    for ( ;; )
+    {
+        struct udma_reap reap = {
+            .completions = (uintptr_t)comp,
+            .max = depth,
+            .timeout_ms = -1,
+        };
+        int n;
+
+        // Top the queue up from the free slots, which are the reaped ones.
+        for ( i = 0; !err && inflight < depth && !done( d, start, issued ) && i < depth; ++i )
+        {
+            struct udma_xfer x;
+
+            if ( t_submit[i] )
+                continue;
+
+            fill_xfer( d, i, &x );
+            t_submit[i] = now_ns();
+            if ( ioctl( d->fd, UDMA_IOC_SUBMIT, &x ) < 0 )
+            {
+                err = errno;
+                t_submit[i] = 0;
+                break;
+            }
+            inflight++;
+            issued++;
+        }
+
+        if ( !inflight )
+            break;
+
+        n = ioctl( d->fd, UDMA_IOC_REAP, &reap );
+        if ( n < 0 )
+        {
+            if ( EINTR == errno )
+                continue;
+            err = errno;
+            break;
+        }
+
+        for ( i = 0; i < (unsigned int)n; ++i )
+        {
+            unsigned int slot = comp[i].user_data;
+
+            record( d, now_ns() - t_submit[slot], comp[i].result );
+            t_submit[slot] = 0;
+            inflight--;
+        }
+
+        if ( err && !inflight )
+            break;
+    }
+
+    out:
+    free( t_submit );
+    free( comp );
+    return err;
+}
+
+static int setup_dir( struct bench_dir * d )
+{
+    const struct bench_opts * o = d->o;
+    size_t len;
+
+    d->fd = open( o->dev, O_RDWR );
+    if ( d->fd < 0 )
+        return errno;
+
+    if ( UDMA_CHAN_NONE != (UDMA_DIR_RX == d->dir ? o->rx_chan : o->tx_chan) )
+    {
+        struct udma_chan_sel sel = {
+            .index = UDMA_DIR_RX == d->dir ? o->rx_chan : o->tx_chan,
+            .dir = d->dir,
+        };
+
+        if ( ioctl( d->fd, UDMA_IOC_SET_CHAN, &sel ) < 0 )
+            return errno;
+    }
+
+    // Each slot starts offset bytes into its own run of pages.
+    d->stride = (o->offset + o->size + PAGE_BYTES - 1) & ~(size_t)(PAGE_BYTES - 1);
+    len = d->stride * o->depth;
+    if ( posix_memalign( (void **)&d->mem, PAGE_BYTES, len ) )
+        return ENOMEM;
+    memset( d->mem, 0xA5, len );    // fault it all in before timing anything
+    d->buf = d->mem + o->offset;
+
+    if ( o->reg )
+    {
+        struct udma_region r = {
+            .addr = (uintptr_t)d->mem,
+            .len = len,
+            .dir = d->dir,
+        };
+
+        if ( ioctl( d->fd, UDMA_IOC_REGISTER, &r ) < 0 )
+            return errno;
+        d->handle = r.handle;
+    }
+
+    return 0;
+}
+
+static void * run_dir( void * arg )
+{
+    struct bench_dir * d = arg;
+    uint64_t start = now_ns();
+
+    if ( d->o->depth > 1 )
+        d->err = run_queued( d, start );
+    else
+        d->err = run_blocking( d, start );
+
+    d->elapsed = (now_ns() - start) / 1e9;
+    return NULL;
+}
+
+static int cmp_u64( const void * a, const void * b )
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double pct_us( const struct bench_dir * d, double p )
+{
+    size_t i;
+
+    if ( !d->num_lat )
+        return 0;
+
+    i = (size_t)(p / 100.0 * (d->num_lat - 1) + 0.5);
+    return d->lat_ns[i] / 1e3;
+}
+
+static double cpu_seconds( void )
+{
+    struct rusage ru;
+
+    getrusage( RUSAGE_SELF, &ru );
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static const char * mode_name( enum bench_mode m )
+{
+    return MODE_TX == m ? "tx" : MODE_RX == m ? "rx" : "duplex";
+}
+
+static void report( const struct bench_dir * d, double cpu_pct )
+{
+    const struct bench_opts * o = d->o;
+    const char * dir = UDMA_DIR_RX == d->dir ? "rx" : "tx";
+    double mbps = d->elapsed ? d->bytes / d->elapsed / 1e6 : 0;
+    double xps = d->elapsed ? d->xfers / d->elapsed : 0;
+    double p50 = pct_us( d, 50 ), p99 = pct_us( d, 99 ), p999 = pct_us( d, 99.9 );
+
+    switch ( o->fmt )
+    {
+    case FMT_CSV:
+        printf( "%s,%s,%zu,%u,%zu,%d,%llu,%llu,%llu,%.6f,%.3f,%.1f,%.3f,%.3f,%.3f,%.1f,%d\n",
+                mode_name( o->mode ), dir, o->size, o->depth, o->offset, o->reg,
+                (unsigned long long)d->xfers, (unsigned long long)d->bytes,
+                (unsigned long long)d->errors, d->elapsed, mbps, xps, p50, p99, p999,
+                cpu_pct, d->err );
+        break;
+    case FMT_JSON:
+        printf( "{\"mode\":\"%s\",\"dir\":\"%s\",\"size\":%zu,\"depth\":%u,\"offset\":%zu,"
+                "\"registered\":%s,\"transfers\":%llu,\"bytes\":%llu,\"errors\":%llu,"
+                "\"seconds\":%.6f,\"mb_s\":%.3f,\"xfers_s\":%.1f,\"p50_us\":%.3f,"
+                "\"p99_us\":%.3f,\"p999_us\":%.3f,\"cpu_pct\":%.1f,\"errno\":%d}\n",
+                mode_name( o->mode ), dir, o->size, o->depth, o->offset,
+                o->reg ? "true" : "false",
+                (unsigned long long)d->xfers, (unsigned long long)d->bytes,
+                (unsigned long long)d->errors, d->elapsed, mbps, xps, p50, p99, p999,
+                cpu_pct, d->err );
+        break;
+    default:
+        printf( "%s %s: size %zu depth %u offset %zu%s: %.1f MB/s, %.0f xfers/s, "
+                "latency p50 %.1f us p99 %.1f us p99.9 %.1f us, cpu %.1f%%",
+                mode_name( o->mode ), dir, o->size, o->depth, o->offset,
+                o->reg ? " registered" : "", mbps, xps, p50, p99, p999, cpu_pct );
+        if ( d->errors )
+            printf( ", %llu errors", (unsigned long long)d->errors );
+        if ( d->err )
+            printf( ", stopped: %s", strerror( d->err ) );
+        printf( "\n" );
+        break;
+    }
+}
+
+static size_t parse_size( const char * s )
+{
+    char * end;
+    size_t v = strtoull( s, &end, 0 );
+
+    switch ( *end )
+    {
+    case 'k': case 'K': return v << 10;
+    case 'm': case 'M': return v << 20;
+    case 'g': case 'G': return v << 30;
+    default:            return v;
+    }
+}
+
+static void usage( const char * prog )
+{
+    fprintf( stderr,
+        "usage: %s [options] /dev/uioN\n"
+        "  -m, --mode tx|rx|duplex   direction(s) to run (default tx)\n"
+        "  -s, --size BYTES          bytes per transfer, k/M/G suffixes (default 4k)\n"
+        "  -d, --depth N             transfers in flight, 1 = blocking (default 1)\n"
+        "  -o, --offset BYTES        start each buffer this far into a page (default 0)\n"
+        "  -r, --register            register the buffers with UDMA_IOC_REGISTER\n"
+        "  -t, --time SECONDS        how long to run each direction (default 2)\n"
+        "  -n, --count N             stop after N transfers instead\n"
+        "      --rx-chan N           RX channel index (default: the file's)\n"
+        "      --tx-chan N           TX channel index (default: the file's)\n"
+        "      --csv                 one CSV line per direction\n"
+        "      --header              with --csv, print the column names first\n"
+        "      --json                one JSON object per direction\n",
+        prog );
+}
+
+int main( int argc, char ** argv )
+{
+    static const struct option longopts[] = {
+        { "mode",       required_argument,  NULL, 'm' },
+        { "size",       required_argument,  NULL, 's' },
+        { "depth",      required_argument,  NULL, 'd' },
+        { "offset",     required_argument,  NULL, 'o' },
+        { "register",   no_argument,        NULL, 'r' },
+        { "time",       required_argument,  NULL, 't' },
+        { "count",      required_argument,  NULL, 'n' },
+        { "rx-chan",    required_argument,  NULL, 'R' },
+        { "tx-chan",    required_argument,  NULL, 'T' },
+        { "csv",        no_argument,        NULL, 'C' },
+        { "header",     no_argument,        NULL, 'H' },
+        { "json",       no_argument,        NULL, 'J' },
+        { "help",       no_argument,        NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    struct bench_opts o = {
+        .mode = MODE_TX,
+        .size = 4096,
+        .depth = 1,
+        .seconds = 2,
+        .rx_chan = UDMA_CHAN_NONE,
+        .tx_chan = UDMA_CHAN_NONE,
+    };
+    struct bench_dir dirs[2];
+    pthread_t threads[2];
+    unsigned int num_dirs = 0, i;
+    double cpu0, cpu_pct, wall;
+    uint64_t t0;
+    int c, rv = 0;
+
+    while ( -1 != (c = getopt_long( argc, argv, "m:s:d:o:rt:n:h", longopts, NULL )) )
+    {
+        switch ( c )
+        {
+        case 'm':
+            if ( !strcmp( optarg, "tx" ) )
+                o.mode = MODE_TX;
+            else if ( !strcmp( optarg, "rx" ) )
+                o.mode = MODE_RX;
+            else if ( !strcmp( optarg, "duplex" ) )
+                o.mode = MODE_DUPLEX;
+            else
+            {
+                usage( argv[0] );
+                return 2;
+            }
+            break;
+        case 's': o.size = parse_size( optarg ); break;
+        case 'd': o.depth = strtoul( optarg, NULL, 0 ); break;
+        case 'o': o.offset = parse_size( optarg ); break;
+        case 'r': o.reg = true; break;
+        case 't': o.seconds = strtod( optarg, NULL ); break;
+        case 'n': o.count = strtoul( optarg, NULL, 0 ); break;
+        case 'R': o.rx_chan = strtol( optarg, NULL, 0 ); break;
+        case 'T': o.tx_chan = strtol( optarg, NULL, 0 ); break;
+        case 'C': o.fmt = FMT_CSV; break;
+        case 'H': o.header = true; break;
+        case 'J': o.fmt = FMT_JSON; break;
+        default:
+            usage( argv[0] );
+            return 'h' == c ? 0 : 2;
+        }
+    }
+
+    if ( optind != argc - 1 || !o.size || !o.depth || o.offset >= PAGE_BYTES )
+    {
+        usage( argv[0] );
+        return 2;
+    }
+    o.dev = argv[optind];
+
+    if ( FMT_CSV == o.fmt && o.header )
+        printf( "mode,dir,size,depth,offset,registered,transfers,bytes,errors,seconds,"
+                "mb_s,xfers_s,p50_us,p99_us,p999_us,cpu_pct,errno\n" );
+
+    memset( dirs, 0, sizeof(dirs) );
+    if ( MODE_TX != o.mode )
+        dirs[num_dirs++].dir = UDMA_DIR_RX;
+    if ( MODE_RX != o.mode )
+        dirs[num_dirs++].dir = UDMA_DIR_TX;
+
+    for ( i = 0; i < num_dirs; ++i )
+    {
+        dirs[i].o = &o;
+        if ( (rv = setup_dir( &dirs[i] )) )
+        {
+            fprintf( stderr, "%s: %s setup: %s\n", o.dev,
+                    UDMA_DIR_RX == dirs[i].dir ? "rx" : "tx", strerror( rv ) );
+            return 1;
+        }
+    }
+
+    // RX goes first, so that on a loopback it is waiting when TX starts.
+    cpu0 = cpu_seconds();
+    t0 = now_ns();
+    for ( i = 0; i < num_dirs; ++i )
+    {
+        if ( pthread_create( &threads[i], NULL, run_dir, &dirs[i] ) )
+        {
+            fprintf( stderr, "pthread_create failed\n" );
+            return 1;
+        }
+    }
+    for ( i = 0; i < num_dirs; ++i )
+        pthread_join( threads[i], NULL );
+    wall = (now_ns() - t0) / 1e9;
+    cpu_pct = wall ? 100.0 * (cpu_seconds() - cpu0) / wall : 0;
+
+    for ( i = 0; i < num_dirs; ++i )
+    {
+        struct bench_dir * d = &dirs[i];
+
+        qsort( d->lat_ns, d->num_lat, sizeof(*d->lat_ns), cmp_u64 );
+        report( d, cpu_pct );
+        if ( d->err || d->errors )
+            rv = 1;
+
+        if ( o.reg )
+            ioctl( d->fd, UDMA_IOC_UNREGISTER, &d->handle );
+        close( d->fd );
+        free( d->mem );
+        free( d->lat_ns );
+    }
+
+    return rv;
+}
@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+# udma_sweep.sh -- run udma_bench over the matrix of transfer sizes, queue
+# depths, buffer offsets, registered/plain buffers and directions, and
+# collect one CSV line per direction per run.  Keep the output of two
+# driver versions and diff or plot them to spot regressions.
+#
+# usage: udma_sweep.sh /dev/uioN [out.csv]
+#
+# Override the matrix through the environment, e.g.
+#   SIZES="4096 65536" DEPTHS="1 16" MODES=duplex udma_sweep.sh /dev/uio0
+#
+set -e
+
+DEV=${1:?usage: $0 /dev/uioN [out.csv]}
+OUT=${2:-udma_sweep-$(uname -r)-$(date +%Y%m%d-%H%M%S).csv}
+BENCH=${BENCH:-$(dirname "$0")/udma_bench}
+
+# 64 B to 64 MiB, by factors of 4.
+SIZES=${SIZES:-"64 256 1024 4096 16384 65536 262144 1048576 4194304 16777216 67108864"}
+DEPTHS=${DEPTHS:-"1 4 16"}
+OFFSETS=${OFFSETS:-"0 64 2048"}
+REGISTER=${REGISTER:-"no yes"}
+MODES=${MODES:-"tx rx duplex"}
+TIME=${TIME:-2}
+
+[ -x "$BENCH" ] || { echo "$0: build $BENCH first" >&2; exit 1; }
+
+echo "mode,dir,size,depth,offset,registered,transfers,bytes,errors,seconds,mb_s,xfers_s,p50_us,p99_us,p999_us,cpu_pct,errno" > "$OUT"
+
+for mode in $MODES; do
+    for reg in $REGISTER; do
+        regflag=
+        [ "$reg" = yes ] && regflag=--register
+        for depth in $DEPTHS; do
+            for offset in $OFFSETS; do
+                for size in $SIZES; do
+                    # A failed run still prints its line, with errno set.
+                    "$BENCH" --csv --mode "$mode" --size "$size" --depth "$depth" \
+                        --offset "$offset" --time "$TIME" $regflag "$DEV" >> "$OUT" || true
+                done
+            done
+        done
+    done
+done
+
+echo "$OUT"
@@ -2,6 +2,7 @@
 #include <linux/device.h>
 #include <linux/platform_device.h>
 #include <linux/of.h>
+#include <linux/property.h>
 #include <linux/types.h>
 #include <linux/list.h>
 #include <linux/slab.h>
@@ -17,554 +18,4399 @@
 #include <linux/fs.h>
 #include <linux/cdev.h>
 #include <linux/wait.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/of_reserved_mem.h>
+#include <linux/sched.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include <linux/udma.h>
 
-static struct udma_drvdata *udma_rx_drvdata, *udma_tx_drvdata;
+#define CREATE_TRACE_POINTS
+#include "udma_trace.h"
 
+// Every platform device udma was set up on, protected by udma_pdev_lock.
+static LIST_HEAD(udma_pdev_list);
+static DEFINE_MUTEX(udma_pdev_lock);
 
+/* Defaults for the kernel buffer pool; the "udma,pool-count",
+ * "udma,pool-size" and "udma,pool-coherent"/"udma,pool-streaming"
+ * device-tree properties override them per device.
+ */
+static unsigned int pool_count;
+module_param(pool_count, uint, S_IRUGO);
+MODULE_PARM_DESC(pool_count, "Number of kernel DMA buffers exported as uio maps (default 0)");
 
-static inline int udma_init(struct platform_device *pdev)
-{
-	printk( KERN_WARNING KBUILD_MODNAME ": udma_init enter\n");
-	udma_tx_drvdata = devm_kzalloc( &pdev->dev, sizeof(*udma_tx_drvdata), GFP_KERNEL );
-	udma_rx_drvdata = devm_kzalloc( &pdev->dev, sizeof(*udma_tx_drvdata), GFP_KERNEL );
-	const char * p_dma_name;
-	int rv;
+static unsigned int pool_size = 1 << 20;
+module_param(pool_size, uint, S_IRUGO);
+MODULE_PARM_DESC(pool_size, "Size of each pool buffer in bytes (default 1 MiB)");
 
-	// tx channel init
-	printk( KERN_WARNING KBUILD_MODNAME ": init start\n");
-	udma_tx_drvdata->pdev = pdev;
-	printk( KERN_WARNING KBUILD_MODNAME ": udma_tx_drvdata->pdev = pdev; enter\n");
-	udma_tx_drvdata->in_use = 0;
-	printk( KERN_WARNING KBUILD_MODNAME ": in_use enter\n");
-	udma_tx_drvdata->state = DMA_IDLE;
-	printk( KERN_WARNING KBUILD_MODNAME ": DMA_IDLE enter\n");
-    spin_lock_init( &udma_tx_drvdata->state_lock );
-    printk( KERN_WARNING KBUILD_MODNAME ": spin_lock_init enter\n");
-    //list_add_tail( &udma_tx_drvdata->node, &p_pdev_info->udma_list );   dont know wut r doing
-    sema_init( &udma_tx_drvdata->sem, 1 );
-    printk( KERN_WARNING KBUILD_MODNAME ": sema_init enter\n");
-    init_waitqueue_head( &udma_tx_drvdata->wq );
-    printk( KERN_WARNING KBUILD_MODNAME ": init_waitqueue_head enter\n");
-    atomic_set( &udma_tx_drvdata->packets_sent, 0 );
-    printk( KERN_WARNING KBUILD_MODNAME ": packets_sent enter\n");
-    atomic_set( &udma_tx_drvdata->packets_rcvd, 0 );
-    printk( KERN_WARNING KBUILD_MODNAME ": packets_rcvd enter\n");
-
-    rv = of_property_read_string_index( pdev->dev.of_node, "dma-names", 0 , &p_dma_name);
-    printk( KERN_WARNING KBUILD_MODNAME ": of_property_read_string_index enter\n");
-    strncpy( udma_tx_drvdata->name, p_dma_name, UDMA_DEV_NAME_MAX_CHARS-1 );
-    printk( KERN_WARNING KBUILD_MODNAME ": strncpy enter\n");
-    udma_tx_drvdata->name[UDMA_DEV_NAME_MAX_CHARS-1] = '\0';
-    printk( KERN_WARNING KBUILD_MODNAME ": name enter\n");
-
-    udma_tx_drvdata->dir = 2;	
-    printk( KERN_WARNING KBUILD_MODNAME ": dir enter\n");
-    udma_tx_drvdata->chan = dma_request_slave_channel(&pdev->dev, udma_tx_drvdata->name);
-
-
-	if ( !udma_tx_drvdata->chan )
-	{
-		printk( KERN_WARNING KBUILD_MODNAME 
-		": couldn't find dma channel: %s, deferring...\n",
-		udma_tx_drvdata->name);
-		return -1;
-	}
-
-	udma_tx_drvdata->init_done = true;
-	atomic_set(&udma_tx_drvdata->accepting, 1);
-	printk( KERN_ALERT KBUILD_MODNAME ": %s (%s) available\n", 
-							udma_tx_drvdata->name,
-							udma_tx_drvdata->dir == UDMA_DEV_TO_CPU ? "RX" : "TX");
+static bool pool_coherent = true;
+module_param(pool_coherent, bool, S_IRUGO);
+MODULE_PARM_DESC(pool_coherent, "Allocate coherent (uncached) rather than streaming pool buffers (default Y)");
 
-    
-    // rx channel init
-    udma_rx_drvdata->pdev = pdev;
-	udma_rx_drvdata->in_use = 0;
-	udma_rx_drvdata->state = DMA_IDLE;
-    spin_lock_init( &udma_rx_drvdata->state_lock );
-    //list_add_tail( &udma_rx_drvdata->node, &p_pdev_info->udma_list );   dont know wut r doing
-    sema_init( &udma_rx_drvdata->sem, 1 );
-    init_waitqueue_head( &udma_rx_drvdata->wq );
-    atomic_set( &udma_rx_drvdata->packets_sent, 0 );
-    atomic_set( &udma_rx_drvdata->packets_rcvd, 0 );
+/* Huge buffers, made of PMD-sized, physically contiguous chunks;
+ * "udma,huge-count" and "udma,huge-size" override these per device.
+ */
+static unsigned int huge_count;
+module_param(huge_count, uint, S_IRUGO);
+MODULE_PARM_DESC(huge_count, "Number of huge (PMD-sized chunk) DMA buffers exported as uio maps (default 0)");
 
-    rv = of_property_read_string_index( pdev->dev.of_node, "dma-names", 1 , &p_dma_name);
-    strncpy( udma_rx_drvdata->name, p_dma_name, UDMA_DEV_NAME_MAX_CHARS-1 );
-    udma_rx_drvdata->name[UDMA_DEV_NAME_MAX_CHARS-1] = '\0';	
-    udma_rx_drvdata->dir = 1;
+static unsigned int huge_size = 32 << 20;
+module_param(huge_size, uint, S_IRUGO);
+MODULE_PARM_DESC(huge_size, "Size of each huge buffer in bytes, rounded up to the PMD size (default 32 MiB)");
 
-    udma_rx_drvdata->chan = dma_request_slave_channel(&pdev->dev, "loop_rx");
+static unsigned int max_inflight = 16;
+module_param(max_inflight, uint, S_IRUGO);
+MODULE_PARM_DESC(max_inflight, "Transfers queued on each dmaengine channel at most (default 16)");
 
-	if ( !udma_rx_drvdata->chan )
-	{
-		printk( KERN_WARNING KBUILD_MODNAME 
-		": couldn't find dma channel: %s, deferring...\n",
-		udma_rx_drvdata->name);
+/* Interrupt moderation: batched transfers (UDMA_XFER_MORE, and all but the
+ * last segment of a read_iter()/write_iter()) only ask for a completion
+ * interrupt every irq_every descriptors, and a timer picks up the rest.
+ */
+static unsigned int irq_every = 16;
+module_param(irq_every, uint, S_IRUGO);
+MODULE_PARM_DESC(irq_every, "Batched descriptors per completion interrupt, at most max_inflight (default 16)");
 
-		return -1;
-	}
-	udma_rx_drvdata->init_done = true;
-	atomic_set(&udma_rx_drvdata->accepting, 1);
-	printk( KERN_ALERT KBUILD_MODNAME ": %s (%s) available\n", 
-							udma_rx_drvdata->name,
-							udma_rx_drvdata->dir == UDMA_DEV_TO_CPU ? "RX" : "TX");
+static unsigned int irq_timeout_us = 200;
+module_param(irq_timeout_us, uint, S_IRUGO);
+MODULE_PARM_DESC(irq_timeout_us, "How soon batched transfers without an interrupt are checked on (default 200 us)");
 
+static unsigned int chunk_size = 4 << 20;
+module_param(chunk_size, uint, S_IRUGO);
+MODULE_PARM_DESC(chunk_size, "Larger read()s and write()s are pipelined in chunks of this many bytes, 0: never (default 4 MiB)");
 
-	return 2;
-  	
-}
+/* Transfer contexts preallocated per channel.  A transfer that fits one
+ * (up to xfer_pool_size bytes of user memory, or a buffer slice of as many
+ * segments) takes no allocation; others, and any beyond the pool, fall
+ * back to allocating their own.
+ */
+static unsigned int xfer_pool = 8;
+module_param(xfer_pool, uint, S_IRUGO);
+MODULE_PARM_DESC(xfer_pool, "Transfer contexts preallocated per channel, 0: allocate every time (default 8)");
+
+static unsigned int xfer_pool_size = 4 << 20;
+module_param(xfer_pool_size, uint, S_IRUGO);
+MODULE_PARM_DESC(xfer_pool_size, "Largest transfer in bytes a preallocated context covers (default 4 MiB)");
+
+static unsigned int busy_poll_us;
+module_param(busy_poll_us, uint, S_IRUGO);
+MODULE_PARM_DESC(busy_poll_us, "How long blocking transfers spin for completion before sleeping, files start with this (default 0, off)");
+
+static unsigned int stripe_size = 1 << 20;
+module_param(stripe_size, uint, S_IRUGO);
+MODULE_PARM_DESC(stripe_size, "Bytes per channel and turn when a write() is striped over \"udma,stripe-group\" (default 1 MiB)");
+
+static bool vectored = true;
+module_param(vectored, bool, S_IRUGO);
+MODULE_PARM_DESC(vectored, "readv()/writev() move all their iovecs as one transfer rather than one each (default Y)");
 
+/* Mapping cache for plain user buffers.  Cached buffers stay pinned until
+ * they are evicted, invalidated or the process exits, so it is off unless
+ * asked for.
+ */
+static unsigned int map_cache;
+module_param(map_cache, uint, S_IRUGO);
+MODULE_PARM_DESC(map_cache, "User buffers kept pinned and mapped per process and device, 0: off (default 0)");
 
-bool is_udma(void)    
+static unsigned int map_cache_mb = 64;
+module_param(map_cache_mb, uint, S_IRUGO);
+MODULE_PARM_DESC(map_cache_mb, "Pinned memory in MiB the mapping cache holds per process and device (default 64)");
+
+
+static enum hrtimer_restart udma_irq_timer_func( struct hrtimer * timer );
+static void udma_xfer_pool_init( struct udma_drvdata * p_info );
+static void udma_xfer_pool_close( struct udma_drvdata * p_info );
+static void udma_mcache_teardown( struct udma_pdev_drvdata * p_pdev_info );
+static void udma_abort( struct udma_drvdata * p_info );
+static int udma_prepare_buf_for_dma( struct udma_inflight_info * p_xfer, struct udma_buf * buf,
+                                     size_t offset, size_t count );
+
+// Torn down: the struct stays until the device goes, but its dma channel may not.
+static inline bool udma_chan_gone( struct udma_drvdata * p_info )
 {
-	bool rv = udma_rx_drvdata->init_done && udma_tx_drvdata->init_done; 
-	return rv;
+    return !READ_ONCE( p_info->init_done );
 }
-EXPORT_SYMBOL_GPL(is_udma);
 
-int check_udma(struct platform_device *pdev)
+/* Engines don't always say which way a channel goes (the Xilinx AXI DMA
+ * driver advertises both directions for every channel), so fall back on
+ * the dma-names entry, e.g. "loop_rx" / "loop_tx".
+ */
+static uint32_t udma_chan_dir( struct udma_drvdata * p_info )
 {
-	printk( KERN_WARNING KBUILD_MODNAME ": check_udma enter\n");
+    struct dma_slave_caps caps;
 
-	int num_dma_names = of_property_count_strings(pdev->dev.of_node, "dma-names");
+    if ( !dma_get_slave_caps( p_info->chan, &caps ) )
+    {
+        const bool rx = caps.directions & BIT(DMA_DEV_TO_MEM);
+        const bool tx = caps.directions & BIT(DMA_MEM_TO_DEV);
 
-    if ( 0 == num_dma_names )  // no udma
+        if ( rx != tx )
+            return rx ? UDMA_DEV_TO_CPU : UDMA_CPU_TO_DEV;
+    }
+
+    return strstr( p_info->name, "rx" ) ? UDMA_DEV_TO_CPU : UDMA_CPU_TO_DEV;
+}
+
+// Set up the channel named p_dma_name, entry <index> of "dma-names", and add it to the device's list.
+static int udma_chan_init( struct udma_pdev_drvdata * p_pdev_info, unsigned int index,
+                           const char * p_dma_name )
+{
+    struct platform_device * pdev = p_pdev_info->pdev;
+    struct udma_drvdata * p_info;
+
+    // Not devm: open files may still look at it after remove, see udma_pdev_release().
+    p_info = kzalloc( sizeof(*p_info), GFP_KERNEL );
+    if ( !p_info )
+        return -ENOMEM;
+
+    // Not devm either: the sysfs directory takes them over, see udma_chan_kobj.
+    p_info->stats = alloc_percpu( struct udma_stats );
+    if ( !p_info->stats )
     {
-        printk( KERN_ERR KBUILD_MODNAME ": no DMAs specified in udma \"dma-names\" property\n");
-        return num_dma_names;
+        kfree( p_info );
+        return -ENOMEM;
     }
-    else if ( num_dma_names < 0 )  // udma information error
+
+    p_info->pdev = pdev;
+    p_info->pdev_info = p_pdev_info;
+    p_info->index = index;
+    p_info->in_use = 0;
+    INIT_LIST_HEAD( &p_info->inflight_list );
+    p_info->max_inflight = max( max_inflight, 1u );
+    spin_lock_init( &p_info->state_lock );
+    sema_init( &p_info->sem, 1 );
+    init_waitqueue_head( &p_info->wq );
+    atomic64_set( &p_info->busy_poll_hits, 0 );
+    atomic64_set( &p_info->busy_poll_fallbacks, 0 );
+    p_info->irq_every = clamp( irq_every, 1u, p_info->max_inflight );
+    p_info->irq_timeout = ns_to_ktime( (u64)max( irq_timeout_us, 1u ) * NSEC_PER_USEC );
+    hrtimer_init( &p_info->irq_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL );
+    p_info->irq_timer.function = udma_irq_timer_func;
+    spin_lock_init( &p_info->xfer_pool_lock );
+    INIT_LIST_HEAD( &p_info->xfer_pool );
+
+    strncpy( p_info->name, p_dma_name, UDMA_DEV_NAME_MAX_CHARS-1 );
+    p_info->name[UDMA_DEV_NAME_MAX_CHARS-1] = '\0';
+
+    p_info->chan = dma_request_slave_channel( &pdev->dev, p_dma_name );
+
+    if ( !p_info->chan )
     {
-        printk( KERN_ERR KBUILD_MODNAME ": got %d when trying to count the elements of \"dma-names\" property\n", num_dma_names);
-        return num_dma_names;   // contains error code
+        printk( KERN_WARNING KBUILD_MODNAME 
+                ": couldn't find dma channel: %s, deferring...\n",
+                p_info->name);
+        free_percpu( p_info->stats );
+        kfree( p_info );
+        return -EPROBE_DEFER;
     }
 
+    p_info->dir = udma_chan_dir( p_info );
 
-    return udma_init(pdev);
-}
-EXPORT_SYMBOL_GPL(check_udma);
+    // Registered buffers may go to any channel, so they are built for the smallest limit.
+    p_info->max_seg_size = dma_get_max_seg_size( p_info->chan->device->dev );
+    if ( !p_pdev_info->max_seg_size || p_info->max_seg_size < p_pdev_info->max_seg_size )
+        p_pdev_info->max_seg_size = p_info->max_seg_size;
 
+    udma_xfer_pool_init( p_info );
 
-static void udma_unprepare_after_dma( struct udma_drvdata * p_info );
+    p_info->init_done = true;
+    atomic_set(&p_info->accepting, 1);
+    list_add_tail( &p_info->node, &p_pdev_info->udma_list );
+    p_pdev_info->num_chans++;
 
-static void udma_dmaengine_callback_func(void *data)
+    // The first channel each way is what read()/write() use until told otherwise.
+    if ( p_info->dir == UDMA_DEV_TO_CPU && !p_pdev_info->rx_default )
+        p_pdev_info->rx_default = p_info;
+    if ( p_info->dir == UDMA_CPU_TO_DEV && !p_pdev_info->tx_default )
+        p_pdev_info->tx_default = p_info;
+
+    printk( KERN_ALERT KBUILD_MODNAME ": %s (%s) available\n", 
+            p_info->name,
+            p_info->dir == UDMA_DEV_TO_CPU ? "RX" : "TX");
+
+    return 0;
+}
+
+static void udma_chan_teardown( struct udma_drvdata * p_info )
 {
-    struct udma_drvdata * p_info = (struct udma_drvdata*)data;
-    unsigned long iflags;
+    printk( KERN_DEBUG KBUILD_MODNAME ": tearing down %s\n",
+            p_info->name );    // name can only be all null-bytes or a valid string
 
-    spin_lock_irqsave(&p_info->state_lock, iflags);
+    atomic_set( &p_info->accepting, 0 );
+    WRITE_ONCE( p_info->init_done, false );    // see udma_chan_gone()
 
-    if ( DMA_IN_FLIGHT == p_info->state )
+    if ( p_info->chan )
     {
-        p_info->state = DMA_COMPLETING;
-        wake_up_interruptible( &p_info->wq );
+        // Waiters get -ECANCELED rather than sleeping on a channel that is going away.
+        udma_abort( p_info );
+        dma_release_channel(p_info->chan);
     }
-    // else: well, nevermind then...
-    
-    spin_unlock_irqrestore(&p_info->state_lock, iflags);
-}
-
+    udma_xfer_pool_close( p_info );
 
+    // With a sysfs directory, the counters go with its last reference.
+    if ( p_info->kobj )
+        kobject_put( &p_info->kobj->kobj );
+    else
+        free_percpu( p_info->stats );
+    p_info->kobj = NULL;
+    p_info->stats = NULL;
+}
 
-static int udma_prepare_for_dma(
-        struct udma_drvdata * p_info, 
-        char __user *userbuf,
-        size_t count
-)
+/* Collect the channels named in "udma,stripe-group" into the device's TX
+ * group.  Without the property, or with a single channel in it, nothing is
+ * striped.
+ */
+static int udma_group_init( struct udma_pdev_drvdata * p_pdev_info )
 {
-    int rv;
+    struct device * dev = &p_pdev_info->pdev->dev;
+    struct udma_chan_group * group = &p_pdev_info->tx_group;
+    const char * names[UDMA_GROUP_MAX_CHANS];
+    struct udma_drvdata * p_info;
+    u32 prop;
+    int num, i;
 
-    BUG_ON( p_info->inflight.pinned_pages ); // should be NULL
-    memset( &p_info->inflight, 0, sizeof( struct udma_inflight_info ) );
-    
-    p_info->inflight.num_pages = (offset_in_page(userbuf) + count + PAGE_SIZE-1) / PAGE_SIZE;
-    p_info->inflight.pinned_pages = kmalloc( 
-        p_info->inflight.num_pages * sizeof(struct page*),
-        GFP_KERNEL);
+    num = device_property_read_string_array( dev, "udma,stripe-group", NULL, 0 );
+    if ( num <= 0 )
+        return 0;
 
-    if ( !p_info->inflight.pinned_pages )
+    if ( num > UDMA_GROUP_MAX_CHANS )
     {
-        rv = -ENOMEM;
-        goto err_out;
+        printk( KERN_ERR KBUILD_MODNAME ": \"udma,stripe-group\" has %d channels, at most %d supported\n",
+                num, UDMA_GROUP_MAX_CHANS);
+        return -EINVAL;
     }
 
-    if ( (rv = sg_alloc_table(
-                    &p_info->inflight.table, 
-                    p_info->inflight.num_pages,
-                    GFP_KERNEL )) )
-    {
-        printk( KERN_ERR KBUILD_MODNAME ": %s: sg_alloc_table() returned %d\n", 
-                p_info->name, rv);
-        goto err_out;
-    }
-    else
+    num = device_property_read_string_array( dev, "udma,stripe-group", names, num );
+    if ( num < 0 )
+        return num;
+
+    for ( i = 0; i < num; ++i )
     {
-        p_info->inflight.table_allocated = 1;
+        list_for_each_entry( p_info, &p_pdev_info->udma_list, node )
+        {
+            if ( !strcmp( p_info->name, names[i] ) )
+                break;
+        }
+
+        // Only TX: RX stripes would end wherever packets do, and one engine can't be stopped alone.
+        if ( &p_info->node == &p_pdev_info->udma_list ||
+             p_info->dir != UDMA_CPU_TO_DEV || p_info->group )
+        {
+            printk( KERN_ERR KBUILD_MODNAME ": \"udma,stripe-group\": %s is not a TX channel, or listed twice\n",
+                    names[i]);
+            group->num_chans = 0;
+            return -EINVAL;
+        }
+
+        group->chans[group->num_chans++] = p_info;
+        p_info->group = group;
     }
 
-    rv = get_user_pages_fast(
-            (unsigned long)userbuf,             // start
-            p_info->inflight.num_pages,
-            p_info->dir == UDMA_DEV_TO_CPU,    // write
-            p_info->inflight.pinned_pages);
+    group->stripe_size = stripe_size;
+    if ( !device_property_read_u32( dev, "udma,stripe-size", &prop ) )
+        group->stripe_size = prop;
 
-    if ( rv != p_info->inflight.num_pages )
+    if ( group->num_chans < 2 || !group->stripe_size )
     {
-        printk( KERN_ERR KBUILD_MODNAME ": %s: get_user_pages_fast() returned %d, expected %d\n",
-                p_info->name, rv, p_info->inflight.num_pages);
-        goto err_out;
+        for ( i = 0; i < group->num_chans; ++i )
+            group->chans[i]->group = NULL;
+        group->num_chans = 0;
+        return 0;
     }
-    else
+
+    printk( KERN_INFO KBUILD_MODNAME ": striping writes over %u channels, %zu bytes each\n",
+            group->num_chans, group->stripe_size);
+    return 0;
+}
+
+static struct udma_pdev_drvdata * udma_find_pdev( struct platform_device * pdev, struct uio_info * uioinfo )
+{
+    struct udma_pdev_drvdata * p_pdev_info;
+
+    list_for_each_entry( p_pdev_info, &udma_pdev_list, node )
     {
-        p_info->inflight.pages_pinned = 1;
+        if ( p_pdev_info->pdev == pdev || (uioinfo && p_pdev_info->uioinfo == uioinfo) )
+            return p_pdev_info;
     }
 
-    // Build scatterlist.
-    {
-        int i;
-        struct scatterlist * sg;
-        struct scatterlist * const sgl = p_info->inflight.table.sgl;
-        const unsigned int num_pages = p_info->inflight.num_pages;
+    return NULL;
+}
 
-        size_t left_to_map = count;
+/* Statistics.  Counters are exported through sysfs under the platform
+ * device, in udma/<channel>/; debugfs has a file per channel, in
+ * udma-<device>/, with the counters and the histograms.
+ */
+static inline void udma_stat_hist( struct udma_drvdata * p_info, enum udma_hist hist, u64 val )
+{
+    this_cpu_inc( p_info->stats->hist[hist][min_t( unsigned int, fls64( val ), UDMA_HIST_BUCKETS - 1 )] );
+}
 
-        for_each_sg( sgl, sg, num_pages, i )
-        {
-            unsigned int len;
-            unsigned int offset;
+// Time spent in a blocking call that started at start (local_clock()).
+static void udma_stat_call( struct udma_drvdata * p_info, u64 start )
+{
+    if ( p_info )
+        udma_stat_hist( p_info, UDMA_HIST_CALL, local_clock() - start );
+}
 
-            len = left_to_map > PAGE_SIZE ? PAGE_SIZE : left_to_map;
+// Sum the u64 at offset in struct udma_stats over all cpus.
+static u64 udma_stat_sum( struct udma_stats __percpu * stats, size_t offset )
+{
+    u64 sum = 0;
+    int cpu;
 
-            if ( 0 == i )
-            {
-                offset = offset_in_page(userbuf);
-                if ( (offset + len) > PAGE_SIZE )
-                    len = PAGE_SIZE - offset;
-            }
-            else
-            {
-                offset = 0;
-            }
+    for_each_possible_cpu( cpu )
+        sum += *(u64 *)((char *)per_cpu_ptr( stats, cpu ) + offset);
 
-            //printk( KERN_DEBUG KBUILD_MODNAME ": %s: sgl[%d]: page: %p, len: %d, offset: %d\n",
-            //        p_info->name, i, p_info->inflight.pinned_pages[i], len, offset );
+    return sum;
+}
 
-            //sg_set_page( sgl, p_info->inflight.pinned_pages[i], len, offset );
-            sg_set_page( sg, p_info->inflight.pinned_pages[i], len, offset );
-            left_to_map -= len;
-        }
+struct udma_stat_attr {
+    struct attribute attr;
+    size_t  offset;     // of the counter in struct udma_stats
+};
+
+#define UDMA_STAT_ATTR(_name, _field) \
+    static struct udma_stat_attr udma_stat_attr_##_name = { \
+        .attr   = { .name = #_name, .mode = S_IRUGO }, \
+        .offset = offsetof(struct udma_stats, _field), \
     }
 
-    // Map the scatterlist 
+UDMA_STAT_ATTR(transfers, transfers);
+UDMA_STAT_ATTR(bytes, bytes);
+UDMA_STAT_ATTR(errors, errors);
+UDMA_STAT_ATTR(terminations, terminations);
+UDMA_STAT_ATTR(interrupted_waits, interrupted);
 
-    rv = dma_map_sg(&p_info->pdev->dev,
-                p_info->inflight.table.sgl,
-                p_info->inflight.num_pages,
-                p_info->dir == UDMA_DEV_TO_CPU ? DMA_FROM_DEVICE : DMA_TO_DEVICE);
+static struct attribute * udma_stat_attrs[] = {
+    &udma_stat_attr_transfers.attr,
+    &udma_stat_attr_bytes.attr,
+    &udma_stat_attr_errors.attr,
+    &udma_stat_attr_terminations.attr,
+    &udma_stat_attr_interrupted_waits.attr,
+    NULL,
+};
 
-    if ( rv != p_info->inflight.num_pages )
-    {
-        printk( KERN_ERR KBUILD_MODNAME ": %s: dma_map_sg() returned %d, expected %d\n", 
-                p_info->name, rv, p_info->inflight.num_pages);
-        goto err_out;
-    }
-    else
-    {
-        p_info->inflight.dma_mapped = 1;
-    }
+static ssize_t udma_stat_attr_show( struct kobject * kobj, struct attribute * attr, char * buf )
+{
+    struct udma_chan_kobj * p_kobj = container_of( kobj, struct udma_chan_kobj, kobj );
+    struct udma_stat_attr * p_attr = container_of( attr, struct udma_stat_attr, attr );
 
-    // Issue DMA request here
-    {
-        struct dma_async_tx_descriptor * txn_desc;
-        struct scatterlist * const sgl = p_info->inflight.table.sgl;
-        dma_cookie_t cookie;
+    return sprintf( buf, "%llu\n", (unsigned long long)udma_stat_sum( p_kobj->stats, p_attr->offset ) );
+}
 
-        txn_desc = dmaengine_prep_slave_sg(
-                p_info->chan,
-                sgl,
-                p_info->inflight.num_pages,
-                p_info->dir == UDMA_DEV_TO_CPU ? DMA_FROM_DEVICE : DMA_TO_DEVICE,
-                DMA_PREP_INTERRUPT);    // run callback after this one
+static const struct sysfs_ops udma_stat_sysfs_ops = {
+    .show   = udma_stat_attr_show,
+};
 
-        if ( !txn_desc )
-        {
-            printk( KERN_ERR KBUILD_MODNAME ": %s: dmaengine_prep_slave_sg() failed\n", p_info->name);
-            rv = -ENOMEM;
-            goto err_out;
-        }
+// The channel is torn down and no stats file is open any more.
+static void udma_chan_kobj_release( struct kobject * kobj )
+{
+    struct udma_chan_kobj * p_kobj = container_of( kobj, struct udma_chan_kobj, kobj );
 
-        txn_desc->callback = udma_dmaengine_callback_func;
-        txn_desc->callback_param = p_info;
+    free_percpu( p_kobj->stats );
+    kfree( p_kobj );
+}
 
-        spin_lock_irq( &p_info->state_lock );
+static struct kobj_type udma_chan_ktype = {
+    .release        = udma_chan_kobj_release,
+    .sysfs_ops      = &udma_stat_sysfs_ops,
+    .default_attrs  = udma_stat_attrs,
+};
 
-        p_info->state = DMA_IN_FLIGHT;
+static const char * const udma_hist_names[UDMA_NUM_HISTS] = {
+    [UDMA_HIST_SIZE]    = "transfer size (bytes)",
+    [UDMA_HIST_PREP]    = "pin and map (ns)",
+    [UDMA_HIST_DMA]     = "submit to completion (ns)",
+    [UDMA_HIST_CALL]    = "blocking call (ns)",
+};
 
-        cookie = dmaengine_submit(txn_desc);
+static int udma_stats_show( struct seq_file * m, void * v )
+{
+    struct udma_drvdata * p_info = m->private;
+    struct attribute ** attr;
+    unsigned int h, b;
 
-        if ( cookie < DMA_MIN_COOKIE )
+    for ( attr = udma_stat_attrs; *attr; ++attr )
+        seq_printf( m, "%s %llu\n", (*attr)->name, (unsigned long long)udma_stat_sum( p_info->stats,
+                    container_of( *attr, struct udma_stat_attr, attr )->offset ) );
+
+    for ( h = 0; h < UDMA_NUM_HISTS; ++h )
+    {
+        seq_printf( m, "\n%s:\n", udma_hist_names[h] );
+
+        for ( b = 0; b < UDMA_HIST_BUCKETS; ++b )
         {
-            printk( KERN_ERR KBUILD_MODNAME ": %s: dmaengine_submit() returned %d\n", p_info->name, cookie);
-            rv = cookie;
-            p_info->state = DMA_IDLE;
+            u64 count = udma_stat_sum( p_info->stats, offsetof(struct udma_stats, hist) +
+                    (h * UDMA_HIST_BUCKETS + b) * sizeof(u64) );
+
+            if ( count )
+                seq_printf( m, "%20llu %llu\n", b ? 1ULL << (b - 1) : 0ULL, (unsigned long long)count );
         }
-        else
+    }
+
+    return 0;
+}
+
+static int udma_stats_open( struct inode * inode, struct file * file )
+{
+    return single_open( file, udma_stats_show, inode->i_private );
+}
+
+static const struct file_operations udma_stats_fops = {
+    .owner      = THIS_MODULE,
+    .open       = udma_stats_open,
+    .read       = seq_read,
+    .llseek     = seq_lseek,
+    .release    = single_release,
+};
+
+// Neither sysfs nor debugfs is essential, so failures here only cost the files.
+static void udma_stats_init( struct udma_pdev_drvdata * p_pdev_info )
+{
+    struct device * dev = &p_pdev_info->pdev->dev;
+    struct udma_drvdata * p_info;
+    char name[64];
+
+    p_pdev_info->sysfs_dir = kobject_create_and_add( "udma", &dev->kobj );
+
+    snprintf( name, sizeof(name), "udma-%s", dev_name( dev ) );
+    p_pdev_info->debugfs_dir = debugfs_create_dir( name, NULL );
+    if ( IS_ERR( p_pdev_info->debugfs_dir ) )
+        p_pdev_info->debugfs_dir = NULL;
+
+    list_for_each_entry( p_info, &p_pdev_info->udma_list, node )
+    {
+        struct udma_chan_kobj * p_kobj = p_pdev_info->sysfs_dir ?
+            kzalloc( sizeof(*p_kobj), GFP_KERNEL ) : NULL;
+
+        if ( p_kobj )
         {
-            p_info->inflight.dma_started = 1;
-            dma_async_issue_pending( p_info->chan );    // Bam!
-            //printk( KERN_ERR KBUILD_MODNAME ": %s: issued pending for %s\n",
-            //        p_info->name,
-            //        p_info->dir == EZDMA_DEV_TO_CPU ? "RX" : "TX" );
+            // Readable as soon as it is added.
+            p_kobj->stats = p_info->stats;
+            if ( kobject_init_and_add( &p_kobj->kobj, &udma_chan_ktype, p_pdev_info->sysfs_dir, "%s", p_info->name ) )
+            {
+                p_kobj->stats = NULL;   // still the channel's
+                kobject_put( &p_kobj->kobj );
+            }
+            else
+                p_info->kobj = p_kobj;
         }
 
-        spin_unlock_irq( &p_info->state_lock );
-
-        if ( cookie < DMA_MIN_COOKIE )
-            goto err_out;
+        if ( p_pdev_info->debugfs_dir )
+            debugfs_create_file( p_info->name, S_IRUGO, p_pdev_info->debugfs_dir, p_info, &udma_stats_fops );
     }
+}
 
-    return 0;
+static void udma_stats_teardown( struct udma_pdev_drvdata * p_pdev_info )
+{
+    struct udma_drvdata * p_info;
 
-    err_out:
+    debugfs_remove_recursive( p_pdev_info->debugfs_dir );
 
-    spin_lock_irq( &p_info->state_lock );
-    udma_unprepare_after_dma( p_info );
-    spin_unlock_irq( &p_info->state_lock );
+    list_for_each_entry( p_info, &p_pdev_info->udma_list, node )
+    {
+        // Out of sysfs; udma_chan_teardown() drops the reference.
+        if ( p_info->kobj )
+            kobject_del( &p_info->kobj->kobj );
+    }
 
-    return rv;
+    kobject_put( p_pdev_info->sysfs_dir );
 }
 
-// should be called with p_info->sem held, and with p_info_state_lock
-static void udma_unprepare_after_dma( struct udma_drvdata * p_info )
+static void udma_pool_buf_free( struct udma_pool_buf * p_buf )
 {
-    p_info->state = DMA_IDLE;
+    struct udma_buf * buf = &p_buf->buf;
+
+    if ( !p_buf->vaddr )
+        return;
 
-    if ( p_info->inflight.dma_mapped )
+    if ( buf->coherent )
     {
-        dma_unmap_sg(p_info->udma_dev,
-                p_info->inflight.table.sgl,
-                p_info->inflight.num_pages,
-                p_info->dir == UDMA_DEV_TO_CPU ? DMA_FROM_DEVICE : DMA_TO_DEVICE);
+        dma_free_coherent( buf->dma_dev, buf->size, p_buf->vaddr, p_buf->dma_addr );
     }
-    p_info->inflight.dma_mapped = 0;
-
-    if ( p_info->inflight.pages_pinned )
+    else
     {
-        if ( p_info->inflight.dma_started && p_info->dir == UDMA_DEV_TO_CPU )
-        {
-            /* Mark all pages dirty for now (not sure how to do this more
-             * efficiently yet -- dmaengine API doesn't seem to return any
-             * notion of how much data was actually transferred).
-             */
+        dma_unmap_single( buf->dma_dev, p_buf->dma_addr, buf->size, buf->dma_dir );
+        free_pages_exact( p_buf->vaddr, buf->size );
+    }
+    p_buf->vaddr = NULL;
 
-            int i;
+    if ( buf->nents )
+        sg_free_table( &buf->table );
+    buf->nents = 0;
+}
 
-            for (i = 0; i < p_info->inflight.num_pages; ++i)
-            {
-                struct page * const page = p_info->inflight.pinned_pages[i];
+static int udma_pool_buf_init(
+        struct udma_pool_buf * p_buf,
+        struct device * dev,
+        size_t size,
+        bool coherent
+)
+{
+    struct udma_buf * buf = &p_buf->buf;
+    int rv;
 
-                set_page_dirty( page );
-                put_page( page );
+    kref_init( &buf->ref );
+    buf->type = UDMA_BUF_POOL;
+    buf->dir = UDMA_DIR_BOTH;
+    buf->dma_dir = DMA_BIDIRECTIONAL;
+    buf->size = size;
+    buf->dma_dev = dev;
+    buf->coherent = coherent;
+
+    if ( coherent )
+    {
+        p_buf->vaddr = dma_alloc_coherent( dev, size, &p_buf->dma_addr, GFP_KERNEL );
+    }
+    else
+    {
+        // Split pages, so uio's fault handler can hand them out one at a time.
+        p_buf->vaddr = alloc_pages_exact( size, GFP_KERNEL | __GFP_ZERO );
+        if ( p_buf->vaddr )
+        {
+            p_buf->dma_addr = dma_map_single( dev, p_buf->vaddr, size, buf->dma_dir );
+            if ( dma_mapping_error( dev, p_buf->dma_addr ) )
+            {
+                free_pages_exact( p_buf->vaddr, size );
+                p_buf->vaddr = NULL;
             }
         }
     }
-    p_info->inflight.pages_pinned = 0;
 
-    if ( p_info->inflight.table_allocated )
-        sg_free_table( &p_info->inflight.table );
-    p_info->inflight.table_allocated = 0;
+    if ( !p_buf->vaddr )
+        return -ENOMEM;
 
-    if ( p_info->inflight.pinned_pages )
+    // One segment covering the whole buffer, so transfers slice it like a registered one.
+    if ( (rv = sg_alloc_table( &buf->table, 1, GFP_KERNEL )) )
     {
-        kfree(p_info->inflight.pinned_pages);
-        p_info->inflight.pinned_pages = NULL;
+        udma_pool_buf_free( p_buf );
+        return rv;
     }
 
+    sg_dma_address( buf->table.sgl ) = p_buf->dma_addr;
+    sg_dma_len( buf->table.sgl ) = size;
+    buf->table.sgl->length = size;
+    buf->nents = 1;
+
+    return 0;
 }
 
-static int check_not_in_flight( struct udma_drvdata * p_info )
+/* Take a buffer's uio map away again, so that userspace can't mmap() its
+ * memory once it is freed.  Pointers into uioinfo are dropped here, or by
+ * udma_maps_clear() at teardown, before uioinfo itself can go.
+ */
+static void udma_mem_clear( struct uio_mem ** p_mem )
 {
-    int rv;
-    spin_lock_irq(&p_info->state_lock);
-    
-    rv = (p_info->state != DMA_IN_FLIGHT);
-    
-    spin_unlock_irq(&p_info->state_lock);
+    struct uio_mem * mem = *p_mem;
 
-    return rv;
+    if ( !mem )
+        return;
+
+    mem->memtype = UIO_MEM_NONE;
+    mem->addr = 0;
+    mem->size = 0;
+    mem->name = NULL;
+    *p_mem = NULL;
+}
+
+static void udma_pool_free( struct udma_pdev_drvdata * p_pdev_info )
+{
+    unsigned int i;
+
+    if ( !p_pdev_info->pool )
+        return;
+
+    for ( i = 0; i < p_pdev_info->pool_count; ++i )
+    {
+        udma_mem_clear( &p_pdev_info->pool[i].mem );
+        udma_pool_buf_free( &p_pdev_info->pool[i] );
+    }
+
+    kfree( p_pdev_info->pool );
+    p_pdev_info->pool = NULL;
 }
 
+// First uio map not taken by a register resource (or an earlier udma buffer).
+static struct uio_mem * udma_first_free_mem( struct uio_info * uioinfo )
+{
+    struct uio_mem * uiomem = &uioinfo->mem[0];
+
+    while ( uiomem < &uioinfo->mem[MAX_UIO_MAPS] && uiomem->size )
+        ++uiomem;
 
-// 
-ssize_t udma_read(struct file *filp, char __user *userbuf, size_t count, loff_t *f_pos)
+    return uiomem;
+}
+
+/* Allocate the pool and describe each buffer in one of the uio maps left
+ * over after the register resources.  Coherent buffers are exported as
+ * physical maps (bus address == physical address, as for uio_dmem_genirq),
+ * streaming ones as logical maps so userspace gets a cached mapping.
+ */
+static int udma_pool_alloc( struct udma_pdev_drvdata * p_pdev_info, struct uio_info * uioinfo )
 {
-	//printk( KERN_WARNING KBUILD_MODNAME ": udma_read enter\n");
+    struct device * dev = &p_pdev_info->pdev->dev;
+    struct uio_mem * uiomem = udma_first_free_mem( uioinfo );
+    unsigned int i;
     int rv;
-    if ( 0 != (count % UDMA_ALIGN_BYTES) )
+
+    if ( &uioinfo->mem[MAX_UIO_MAPS] - uiomem < p_pdev_info->pool_count )
     {
-        printk( KERN_WARNING KBUILD_MODNAME ": %s: unaligned read of %u bytes requested\n", udma_rx_drvdata->name, count);
-        return -EINVAL;
+        p_pdev_info->pool_count = &uioinfo->mem[MAX_UIO_MAPS] - uiomem;
+        printk( KERN_WARNING KBUILD_MODNAME ": only %u uio maps left, pool truncated\n",
+                p_pdev_info->pool_count);
+        if ( !p_pdev_info->pool_count )
+            return 0;
     }
-    //printk( KERN_WARNING KBUILD_MODNAME ": UDMA_ALIGN_BYTES pass\n");
-    if ( down_interruptible( &udma_rx_drvdata->sem ) )
-        return -ERESTARTSYS;
-	//printk( KERN_WARNING KBUILD_MODNAME ": down_interruptible pass\n");
-    if ( !atomic_read(&udma_rx_drvdata->accepting ) )
-    {
-        printk( KERN_WARNING KBUILD_MODNAME ": atomic_read failed\n");
-        rv = -EBADF;
-    } 
-    else
+
+    p_pdev_info->pool = kcalloc( p_pdev_info->pool_count, sizeof(*p_pdev_info->pool), GFP_KERNEL );
+    if ( !p_pdev_info->pool )
+        return -ENOMEM;
+
+    for ( i = 0; i < p_pdev_info->pool_count; ++i, ++uiomem )
     {
-        int prep_rv;
-        int wait_rv;
+        struct udma_pool_buf * p_buf = &p_pdev_info->pool[i];
 
-        prep_rv = udma_prepare_for_dma( udma_rx_drvdata , userbuf, count );
-		
-        if (prep_rv)
+        if ( (rv = udma_pool_buf_init( p_buf, dev, p_pdev_info->pool_size, p_pdev_info->pool_coherent )) )
         {
-            rv = prep_rv;
-            goto out;
+            printk( KERN_ERR KBUILD_MODNAME ": couldn't allocate %zu byte pool buffer %u\n",
+                    p_pdev_info->pool_size, i);
+            udma_pool_free( p_pdev_info );
+            p_pdev_info->pool_count = 0;
+            return rv;
         }
-		//printk( KERN_WARNING KBUILD_MODNAME ": udma_prepare_for_dma pass\n");
-        up( &udma_rx_drvdata->sem );
-
-        wait_rv = wait_event_interruptible( udma_rx_drvdata->wq, check_not_in_flight(udma_rx_drvdata) );
 
-        if ( down_timeout( &udma_rx_drvdata->sem, SEM_TAKE_TIMEOUT ) )
+        if ( p_pdev_info->pool_coherent )
         {
-            printk( KERN_ALERT KBUILD_MODNAME 
-                    ": %s: read sem take stalled for %d seconds -- probably broken\n",
-                    udma_rx_drvdata->name, 
-                    SEM_TAKE_TIMEOUT);
-            goto noup_out;
+            uiomem->memtype = UIO_MEM_PHYS;
+            uiomem->addr = p_buf->dma_addr;
         }
-
-        spin_lock_irq(&udma_rx_drvdata->state_lock);
-        if ( udma_rx_drvdata->state == DMA_IN_FLIGHT && -ERESTARTSYS == wait_rv )
+        else
         {
-            dmaengine_terminate_all( udma_rx_drvdata->chan );
-            rv = wait_rv;
+            uiomem->memtype = UIO_MEM_LOGICAL;
+            uiomem->addr = (phys_addr_t)(unsigned long)p_buf->vaddr;
         }
-
-        udma_unprepare_after_dma( udma_rx_drvdata );    // sets us back to DMA_IDLE
-        spin_unlock_irq(&udma_rx_drvdata->state_lock);
+        uiomem->size = p_pdev_info->pool_size;
+        uiomem->name = devm_kasprintf( dev, GFP_KERNEL, "udma_pool%u", i );
+        p_buf->mem = uiomem;
     }
 
-    out:
-    up( &udma_rx_drvdata->sem );
+    printk( KERN_ALERT KBUILD_MODNAME ": %u x %zu byte %s pool buffers available\n",
+            p_pdev_info->pool_count, p_pdev_info->pool_size,
+            p_pdev_info->pool_coherent ? "coherent" : "streaming");
 
-    noup_out:
-    return rv;   
+    return 0;
 }
-EXPORT_SYMBOL_GPL(udma_read);
 
-ssize_t udma_write(struct file *filp, const char __user *userbuf, size_t count, loff_t *f_pos)
+// Huge buffers
+
+static void udma_huge_buf_free( struct udma_huge_buf * p_buf )
 {
-    //printk( KERN_WARNING KBUILD_MODNAME ": udma_write enter\n");
-    //struct udma_drvdata * p_info = (struct ezdma_drvdata*)filp->private_data;
-    ssize_t rv = count;
+    struct udma_buf * buf = &p_buf->buf;
+    unsigned int i;
 
-    // Ensure this is a writable device.
-    //if ( EZDMA_CPU_TO_DEV != p_info->dir )
-    //{
-    //    printk( KERN_WARNING KBUILD_MODNAME ": %s: can't write, is an RX device\n", p_info->name);
-    //    return -EINVAL;
-    //}
-    if ( 0 != (count % UDMA_ALIGN_BYTES) )
-    {
-        printk( KERN_WARNING KBUILD_MODNAME ": %s: unaligned write of %u bytes requested\n", udma_tx_drvdata->name, count);
-        return -EINVAL;
-    }
-    //printk( KERN_WARNING KBUILD_MODNAME ": UDMA_ALIGN_BYTES enter\n");
-    // Ensure this is a writable device.
+    if ( !p_buf->chunks )
+        return;
 
-    if ( down_interruptible( &udma_tx_drvdata->sem ) )
-        return -ERESTARTSYS;
-    //printk( KERN_WARNING KBUILD_MODNAME ": down_interruptible enter\n");
-    if ( !atomic_read(&udma_tx_drvdata->accepting ) )
+    if ( buf->nents )
+        dma_unmap_sg( buf->dma_dev, buf->table.sgl, buf->table.nents, buf->dma_dir );
+    buf->nents = 0;
+
+    if ( buf->table.sgl )
+        sg_free_table( &buf->table );
+
+    for ( i = 0; i < p_buf->num_chunks; ++i )
     {
-        rv = -EBADF;
-        goto out;
+        if ( p_buf->chunks[i] )
+            __free_pages( p_buf->chunks[i], UDMA_HUGE_ORDER );
     }
-    else
-    {
-        int prep_rv;
-        int wait_rv;
 
-        prep_rv = udma_prepare_for_dma( udma_tx_drvdata, (char __user*)userbuf, count );
+    kfree( p_buf->chunks );
+    p_buf->chunks = NULL;
+}
 
-        if (prep_rv)
-        {
-            rv = prep_rv;
-            goto out;
-        }
-    	//printk( KERN_WARNING KBUILD_MODNAME ": udma_prepare_for_dma enter\n");
+/* Build a buffer out of PMD-sized, physically contiguous chunks, so that a
+ * transfer into it is a handful of large segments.
+ */
+static int udma_huge_buf_init( struct udma_huge_buf * p_buf, struct device * dev, size_t size )
+{
+    struct udma_buf * buf = &p_buf->buf;
+    struct scatterlist * sg;
+    unsigned int i;
+    int rv;
 
-        up( &udma_tx_drvdata->sem );
+    kref_init( &buf->ref );
+    buf->type = UDMA_BUF_HUGE;
+    buf->dir = UDMA_DIR_BOTH;
+    buf->dma_dir = DMA_BIDIRECTIONAL;
+    buf->size = size;
+    buf->dma_dev = dev;
+    buf->coherent = false;
 
-        wait_rv = wait_event_interruptible( udma_tx_drvdata->wq, check_not_in_flight(udma_tx_drvdata) );
+    p_buf->num_chunks = size >> (UDMA_HUGE_ORDER + PAGE_SHIFT);
+    p_buf->chunks = kcalloc( p_buf->num_chunks, sizeof(struct page*), GFP_KERNEL );
+    if ( !p_buf->chunks )
+        return -ENOMEM;
 
-        if ( down_timeout( &udma_tx_drvdata->sem, SEM_TAKE_TIMEOUT ) )
-        {
-            printk( KERN_ALERT KBUILD_MODNAME 
-                    ": %s: write sem take stalled for %d seconds -- probably broken\n",
-                    udma_tx_drvdata->name,
-                    SEM_TAKE_TIMEOUT);
-            goto noup_out;
-        }
+    if ( (rv = sg_alloc_table( &buf->table, p_buf->num_chunks, GFP_KERNEL )) )
+        goto err_out;
 
-        spin_lock_irq(&udma_tx_drvdata->state_lock);
-        if ( udma_tx_drvdata->state == DMA_IN_FLIGHT && -ERESTARTSYS == wait_rv )
+    for_each_sg( buf->table.sgl, sg, p_buf->num_chunks, i )
+    {
+        p_buf->chunks[i] = alloc_pages( GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN | __GFP_NORETRY,
+                                        UDMA_HUGE_ORDER );
+        if ( !p_buf->chunks[i] )
         {
-            dmaengine_terminate_all( udma_tx_drvdata->chan );
-            rv = wait_rv;
+            rv = -ENOMEM;
+            goto err_out;
         }
 
-        udma_unprepare_after_dma( udma_tx_drvdata );    // sets us back to DMA_IDLE
-        spin_unlock_irq(&udma_tx_drvdata->state_lock);
+        sg_set_page( sg, p_buf->chunks[i], UDMA_HUGE_SIZE, 0 );
     }
 
-    out:
-    up( &udma_tx_drvdata->sem );
+    buf->nents = dma_map_sg( dev, buf->table.sgl, buf->table.nents, buf->dma_dir );
+    if ( !buf->nents )
+    {
+        rv = -ENOMEM;
+        goto err_out;
+    }
+
+    return 0;
 
-    noup_out:
+    err_out:
+    udma_huge_buf_free( p_buf );
     return rv;
-    
 }
-EXPORT_SYMBOL_GPL(udma_write);
 
-void teardown_udma( struct platform_device *pdev)
+static void udma_huge_free( struct udma_pdev_drvdata * p_pdev_info )
 {
-	if (udma_tx_drvdata->init_done){
-		// teardown udma_tx_drvdata channel
-	    printk( KERN_DEBUG KBUILD_MODNAME ": tearing down %s\n",
-	                udma_tx_drvdata->name );    // name can only be all null-bytes or a valid string
-
-	    if ( udma_tx_drvdata->chan )
-	    {
-	        dmaengine_terminate_all(udma_tx_drvdata->chan);
-	        dma_release_channel(udma_tx_drvdata->chan);
-	    }
-	    udma_tx_drvdata->init_done = false;
-	}
-
-	if (udma_rx_drvdata->init_done) {
-		// teardown udma_rx_drvdata channel
-    	printk( KERN_DEBUG KBUILD_MODNAME ": tearing down %s\n",
-                udma_rx_drvdata->name );    // name can only be all null-bytes or a valid string
-
-    	if ( udma_rx_drvdata->chan )
-    	{
-        	dmaengine_terminate_all(udma_rx_drvdata->chan);
-        	dma_release_channel(udma_rx_drvdata->chan);
-    	}  
-    	udma_rx_drvdata->init_done = false;
-	}
-
-  
+    unsigned int i;
+
+    if ( !p_pdev_info->huge )
+        return;
+
+    for ( i = 0; i < p_pdev_info->huge_count; ++i )
+    {
+        udma_mem_clear( &p_pdev_info->huge[i].mem );
+        udma_huge_buf_free( &p_pdev_info->huge[i] );
+    }
+
+    kfree( p_pdev_info->huge );
+    p_pdev_info->huge = NULL;
+}
+
+// Like udma_pool_alloc(), for the huge buffers; they get the maps after the pool's.
+static int udma_huge_alloc( struct udma_pdev_drvdata * p_pdev_info, struct uio_info * uioinfo )
+{
+    struct device * dev = &p_pdev_info->pdev->dev;
+    struct uio_mem * uiomem = udma_first_free_mem( uioinfo );
+    unsigned int i;
+    int rv;
+
+    if ( &uioinfo->mem[MAX_UIO_MAPS] - uiomem < p_pdev_info->huge_count )
+    {
+        p_pdev_info->huge_count = &uioinfo->mem[MAX_UIO_MAPS] - uiomem;
+        printk( KERN_WARNING KBUILD_MODNAME ": only %u uio maps left, huge buffers truncated\n",
+                p_pdev_info->huge_count);
+        if ( !p_pdev_info->huge_count )
+            return 0;
+    }
+
+    p_pdev_info->huge = kcalloc( p_pdev_info->huge_count, sizeof(*p_pdev_info->huge), GFP_KERNEL );
+    if ( !p_pdev_info->huge )
+        return -ENOMEM;
+
+    for ( i = 0; i < p_pdev_info->huge_count; ++i, ++uiomem )
+    {
+        struct udma_huge_buf * p_buf = &p_pdev_info->huge[i];
+
+        if ( (rv = udma_huge_buf_init( p_buf, dev, p_pdev_info->huge_size )) )
+        {
+            printk( KERN_ERR KBUILD_MODNAME ": couldn't allocate %zu byte huge buffer %u\n",
+                    p_pdev_info->huge_size, i);
+            udma_huge_free( p_pdev_info );
+            p_pdev_info->huge_count = 0;
+            return rv;
+        }
+
+        uiomem->memtype = UIO_MEM_UDMA;
+        uiomem->addr = page_to_phys( p_buf->chunks[0] );   // informational, it isn't contiguous
+        uiomem->size = p_pdev_info->huge_size;
+        uiomem->name = devm_kasprintf( dev, GFP_KERNEL, "udma_huge%u", i );
+        p_buf->mem = uiomem;
+    }
+
+    printk( KERN_ALERT KBUILD_MODNAME ": %u x %zu byte huge buffers available\n",
+            p_pdev_info->huge_count, p_pdev_info->huge_size);
+
+    return 0;
+}
+
+// The cyclic mode status page, one struct udma_ring_status per channel, in the next free map.
+static int udma_status_alloc( struct udma_pdev_drvdata * p_pdev_info, struct uio_info * uioinfo )
+{
+    struct device * dev = &p_pdev_info->pdev->dev;
+    struct uio_mem * uiomem = udma_first_free_mem( uioinfo );
+
+    if ( uiomem >= &uioinfo->mem[MAX_UIO_MAPS] )
+    {
+        printk( KERN_WARNING KBUILD_MODNAME ": no uio map left for udma_status, cyclic mode unavailable\n");
+        return 0;
+    }
+
+    p_pdev_info->status = (struct udma_ring_status *)devm_get_free_pages( dev, GFP_KERNEL | __GFP_ZERO, 0 );
+    if ( !p_pdev_info->status )
+        return -ENOMEM;
+
+    uiomem->memtype = UIO_MEM_LOGICAL;
+    uiomem->addr = (phys_addr_t)(unsigned long)p_pdev_info->status;
+    uiomem->size = PAGE_SIZE;
+    uiomem->name = "udma_status";
+
+    return 0;
+}
+
+/* Clear the uio maps of the pool and huge buffers while uioinfo is still
+ * around; exported dma-bufs may keep the buffers themselves for longer.
+ */
+static void udma_maps_clear( struct udma_pdev_drvdata * p_pdev_info )
+{
+    unsigned int i;
+
+    for ( i = 0; p_pdev_info->pool && i < p_pdev_info->pool_count; ++i )
+        udma_mem_clear( &p_pdev_info->pool[i].mem );
+
+    for ( i = 0; p_pdev_info->huge && i < p_pdev_info->huge_count; ++i )
+        udma_mem_clear( &p_pdev_info->huge[i].mem );
+}
+
+/* The device and every dma-buf exported from its buffers hold a reference
+ * on p_pdev_info; the last one to go frees the buffers.
+ */
+static void udma_pdev_release( struct kref * ref )
+{
+    struct udma_pdev_drvdata * p_pdev_info = container_of( ref, struct udma_pdev_drvdata, ref );
+    struct udma_drvdata * p_info, * tmp;
+
+    // Torn down already; only the memory was left for files that were still open.
+    list_for_each_entry_safe( p_info, tmp, &p_pdev_info->udma_list, node )
+    {
+        list_del( &p_info->node );
+        kfree( p_info );
+    }
+
+    udma_huge_free( p_pdev_info );
+    udma_pool_free( p_pdev_info );
+
+    if ( p_pdev_info->reserved_mem )
+        of_reserved_mem_device_release( &p_pdev_info->pdev->dev );
+
+    put_device( &p_pdev_info->pdev->dev );
+    kfree( p_pdev_info );
+}
+
+static struct udma_huge_buf * udma_find_huge( struct uio_mem * mem )
+{
+    struct udma_pdev_drvdata * p_pdev_info;
+    struct udma_huge_buf * p_buf = NULL;
+    unsigned int i;
+
+    mutex_lock( &udma_pdev_lock );
+
+    list_for_each_entry( p_pdev_info, &udma_pdev_list, node )
+    {
+        for ( i = 0; i < p_pdev_info->huge_count; ++i )
+        {
+            if ( p_pdev_info->huge[i].mem == mem )
+            {
+                p_buf = &p_pdev_info->huge[i];
+                goto out;
+            }
+        }
+    }
+
+    out:
+    mutex_unlock( &udma_pdev_lock );
+    return p_buf;
+}
+
+/* mmap() of a UIO_MEM_UDMA map, called from uio_mmap().  The chunks are
+ * mapped up front with remap_pfn_range(), a chunk at a time, with small
+ * PTEs.  Huge buffers only save on DMA segments, not on TLB misses: this
+ * kernel zaps a PMD as DAX, anonymous or shmem memory, and a driver's
+ * pages are none of those.
+ */
+int udma_mmap(struct uio_mem *mem, struct vm_area_struct *vma)
+{
+    struct udma_huge_buf * p_buf = udma_find_huge( mem );
+    unsigned long addr = vma->vm_start;
+    unsigned int i;
+    int rv;
+
+    if ( !p_buf )
+        return -ENODEV;
+
+    // pfn mappings can't be copied on write.
+    if ( !(vma->vm_flags & VM_SHARED) )
+        return -EINVAL;
+    if ( vma->vm_end - vma->vm_start > p_buf->buf.size )
+        return -EINVAL;
+
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+
+    for ( i = 0; addr < vma->vm_end; ++i, addr += UDMA_HUGE_SIZE )
+    {
+        const unsigned long len = min_t( unsigned long, vma->vm_end - addr, UDMA_HUGE_SIZE );
+
+        rv = remap_pfn_range( vma, addr, page_to_pfn( p_buf->chunks[i] ), len, vma->vm_page_prot );
+        if ( rv )
+            return rv;
+    }
+
+    return 0;
+}
+EXPORT_SYMBOL_GPL(udma_mmap);
+
+// Bus address of a uio map backed by a pool buffer, for its "dma_addr" attribute.
+int udma_mem_dma_addr(struct uio_mem *mem, dma_addr_t *dma_addr)
+{
+    struct udma_pdev_drvdata * p_pdev_info;
+    unsigned int i;
+    int rv = -ENODEV;
+
+    mutex_lock( &udma_pdev_lock );
+
+    list_for_each_entry( p_pdev_info, &udma_pdev_list, node )
+    {
+        for ( i = 0; i < p_pdev_info->pool_count; ++i )
+        {
+            if ( p_pdev_info->pool[i].mem == mem )
+            {
+                *dma_addr = p_pdev_info->pool[i].dma_addr;
+                rv = 0;
+                goto out;
+            }
+        }
+    }
+
+    out:
+    mutex_unlock( &udma_pdev_lock );
+    return rv;
+}
+EXPORT_SYMBOL_GPL(udma_mem_dma_addr);
+
+int check_udma(struct platform_device *pdev, struct uio_info *uioinfo)
+{
+	printk( KERN_WARNING KBUILD_MODNAME ": check_udma enter\n");
+
+	struct device_node * np = pdev->dev.of_node;
+	struct device * dev = &pdev->dev;
+	struct udma_pdev_drvdata * p_pdev_info;
+	struct udma_drvdata * p_info, * tmp;
+	const char ** dma_names;
+	u32 prop;
+	int rv;
+	int i;
+
+	// Through the fwnode, so that devices without a device tree node (udma_soft_dma's) work too.
+	int num_dma_names = device_property_read_string_array(dev, "dma-names", NULL, 0);
+
+    if ( !device_property_present( dev, "dma-names" ) )   // plain uio device, nothing to do
+        return 0;
+
+    if ( 0 == num_dma_names )  // no udma
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": no DMAs specified in udma \"dma-names\" property\n");
+        return num_dma_names;
+    }
+    else if ( num_dma_names < 0 )  // udma information error
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": got %d when trying to count the elements of \"dma-names\" property\n", num_dma_names);
+        return num_dma_names;   // contains error code
+    }
+
+    // Not devm: dma-bufs exported from its buffers can outlive the device's driver.
+    p_pdev_info = kzalloc( sizeof(*p_pdev_info), GFP_KERNEL );
+    if ( !p_pdev_info )
+        return -ENOMEM;
+
+    kref_init( &p_pdev_info->ref );
+    p_pdev_info->pdev = pdev;
+    p_pdev_info->uioinfo = uioinfo;
+    INIT_LIST_HEAD( &p_pdev_info->udma_list );
+    mutex_init( &p_pdev_info->mcache_lock );
+    INIT_LIST_HEAD( &p_pdev_info->mcaches );
+    get_device( &pdev->dev );
+
+    dma_names = kcalloc( num_dma_names, sizeof(*dma_names), GFP_KERNEL );
+    if ( !dma_names )
+    {
+        rv = -ENOMEM;
+        goto err_out;
+    }
+
+    rv = device_property_read_string_array( dev, "dma-names", dma_names, num_dma_names );
+    for ( i = 0; rv >= 0 && i < num_dma_names; ++i )
+        rv = udma_chan_init( p_pdev_info, i, dma_names[i] );
+    kfree( dma_names );     // the strings themselves belong to the property
+    if ( rv < 0 )
+        goto err_out;
+
+    if ( (rv = udma_group_init( p_pdev_info )) )
+        goto err_out;
+
+    p_pdev_info->pool_count = pool_count;
+    p_pdev_info->pool_size = pool_size;
+    p_pdev_info->pool_coherent = pool_coherent;
+
+    if ( !device_property_read_u32( dev, "udma,pool-count", &prop ) )
+        p_pdev_info->pool_count = prop;
+    if ( !device_property_read_u32( dev, "udma,pool-size", &prop ) )
+        p_pdev_info->pool_size = prop;
+    if ( device_property_read_bool( dev, "udma,pool-streaming" ) )
+        p_pdev_info->pool_coherent = false;
+    if ( device_property_read_bool( dev, "udma,pool-coherent" ) )
+        p_pdev_info->pool_coherent = true;
+
+    p_pdev_info->pool_size = PAGE_ALIGN( p_pdev_info->pool_size );
+
+    p_pdev_info->huge_count = huge_count;
+    p_pdev_info->huge_size = huge_size;
+
+    if ( !device_property_read_u32( dev, "udma,huge-count", &prop ) )
+        p_pdev_info->huge_count = prop;
+    if ( !device_property_read_u32( dev, "udma,huge-size", &prop ) )
+        p_pdev_info->huge_size = prop;
+
+    p_pdev_info->huge_size = ALIGN( p_pdev_info->huge_size, UDMA_HUGE_SIZE );
+
+    // Coherent pool buffers come out of the device's CMA or reserved region, if it has one.
+    if ( of_find_property( np, "memory-region", NULL ) )
+    {
+        if ( (rv = of_reserved_mem_device_init( &pdev->dev )) )
+            goto err_out;
+        p_pdev_info->reserved_mem = true;
+    }
+
+    if ( p_pdev_info->pool_count && p_pdev_info->pool_size )
+    {
+        if ( (rv = udma_pool_alloc( p_pdev_info, uioinfo )) )
+            goto err_out;
+    }
+
+    if ( p_pdev_info->huge_count && p_pdev_info->huge_size )
+    {
+        if ( (rv = udma_huge_alloc( p_pdev_info, uioinfo )) )
+            goto err_out;
+    }
+
+    if ( (rv = udma_status_alloc( p_pdev_info, uioinfo )) )
+        goto err_out;
+
+    udma_stats_init( p_pdev_info );
+
+    mutex_lock( &udma_pdev_lock );
+    list_add_tail( &p_pdev_info->node, &udma_pdev_list );
+    mutex_unlock( &udma_pdev_lock );
+
+    return p_pdev_info->num_chans;
+
+    // udma_pdev_release() frees whatever buffers were allocated, and clears their maps.
+    err_out:
+    list_for_each_entry_safe( p_info, tmp, &p_pdev_info->udma_list, node )
+        udma_chan_teardown( p_info );
+    kref_put( &p_pdev_info->ref, udma_pdev_release );
+    return rv;
+}
+EXPORT_SYMBOL_GPL(check_udma);
+
+
+static enum dma_data_direction udma_dma_dir( uint32_t dir )
+{
+    switch ( dir )
+    {
+    case UDMA_DIR_RX:
+        return DMA_FROM_DEVICE;
+    case UDMA_DIR_TX:
+        return DMA_TO_DEVICE;
+    default:
+        return DMA_BIDIRECTIONAL;
+    }
+}
+
+/* Add the pages of one user range to a scatterlist being filled in: *p_sg
+ * is the entry filled in last (NULL to start with), *p_next the next free
+ * one.  Physically contiguous pages (THP, hugetlb, CMA...) share an entry
+ * as long as it stays within max_seg bytes, so a big transfer doesn't turn
+ * into one descriptor per page; a range always starts a new one.  Returns
+ * the number of entries used.
+ */
+static unsigned int udma_fill_sg_range(
+        struct scatterlist ** p_sg,
+        struct scatterlist ** p_next,
+        struct page ** pages,
+        unsigned int num_pages,
+        unsigned int offset,
+        size_t count,
+        unsigned int max_seg
+)
+{
+    struct scatterlist * sg = *p_sg;
+    struct scatterlist * next = *p_next;
+    unsigned int nents = 0;
+    unsigned int i;
+
+    size_t left_to_map = count;
+
+    for ( i = 0; i < num_pages; ++i )
+    {
+        unsigned int len = min_t( size_t, left_to_map, PAGE_SIZE - offset );
+
+        if ( i && page_to_pfn( pages[i] ) == page_to_pfn( pages[i-1] ) + 1 &&
+             sg->length + len <= max_seg )
+        {
+            sg->length += len;
+        }
+        else
+        {
+            sg = next;
+            next = sg_next( sg );
+            sg_set_page( sg, pages[i], len, offset );
+            ++nents;
+        }
+
+        offset = 0;
+        left_to_map -= len;
+    }
+
+    *p_sg = sg;
+    *p_next = next;
+    return nents;
+}
+
+/* Fill a table allocated with num_pages entries so that it covers count
+ * bytes of the pinned pages, starting offset bytes into the first one, as
+ * a single range.  The table is trimmed to the entries actually used.
+ */
+static void udma_fill_sgl(
+        struct sg_table * table,
+        struct page ** pages,
+        unsigned int num_pages,
+        unsigned int offset,
+        size_t count,
+        unsigned int max_seg
+)
+{
+    struct scatterlist * sg = NULL;
+    struct scatterlist * next = table->sgl;
+
+    table->nents = udma_fill_sg_range( &sg, &next, pages, num_pages, offset, count, max_seg );
+    sg_mark_end( sg );      // orig_nents still says what to free
+}
+
+/* Give table nents entries: spare's, when there is a spare big enough (a
+ * pooled transfer's), otherwise newly allocated ones.  The caller marks
+ * the end of what it fills in.
+ */
+static int udma_table_get( struct sg_table * table, struct sg_table * spare, unsigned int nents )
+{
+    if ( spare && spare->sgl && nents <= spare->orig_nents )
+    {
+        *table = *spare;
+        table->nents = nents;
+        return 0;
+    }
+
+    return sg_alloc_table( table, nents, GFP_KERNEL );
+}
+
+static void udma_table_put( struct sg_table * table, struct sg_table * spare )
+{
+    struct scatterlist * sg, * last = NULL;
+    unsigned int i;
+
+    if ( !spare || table->sgl != spare->sgl )
+    {
+        sg_free_table( table );
+        return;
+    }
+
+    // Clear the end mark for the next user, unless it is the table's own.
+    for_each_sg( table->sgl, sg, table->nents, i )
+        last = sg;
+    if ( last && table->nents < spare->orig_nents )
+        sg_unmark_end( last );
+}
+
+/* Build a table that describes [offset, offset+count) of a registered
+ * buffer.  Only the DMA address and length of each entry are filled in,
+ * which is all a slave_sg transfer looks at.  Mapped segments longer than
+ * max_seg (a pool buffer is a single one) are split.
+ */
+static int udma_buf_slice(
+        struct udma_buf * buf,
+        size_t offset,
+        size_t count,
+        unsigned int max_seg,
+        struct sg_table * table,
+        struct sg_table * spare
+)
+{
+    struct scatterlist * sg;
+    struct scatterlist * out;
+    unsigned int nents = 0;
+    size_t skip;
+    size_t left;
+    int i;
+    int rv;
+
+    // First pass: count the mapped segments the range touches.
+    skip = offset;
+    left = count;
+
+    for_each_sg( buf->table.sgl, sg, buf->nents, i )
+    {
+        size_t len = sg_dma_len( sg );
+
+        if ( skip >= len )
+        {
+            skip -= len;
+            continue;
+        }
+
+        len -= skip;
+        skip = 0;
+
+        if ( len > left )
+            len = left;
+        nents += DIV_ROUND_UP( len, max_seg );
+
+        left -= len;
+        if ( 0 == left )
+            break;
+    }
+
+    if ( (rv = udma_table_get( table, spare, nents )) )
+        return rv;
+
+    // Second pass: fill it in.
+    skip = offset;
+    left = count;
+    out = table->sgl;
+
+    for_each_sg( buf->table.sgl, sg, buf->nents, i )
+    {
+        size_t len = sg_dma_len( sg );
+
+        if ( skip >= len )
+        {
+            skip -= len;
+            continue;
+        }
+
+        len -= skip;
+        if ( len > left )
+            len = left;
+
+        while ( len )
+        {
+            const size_t seg = min_t( size_t, len, max_seg );
+
+            sg_dma_address( out ) = sg_dma_address( sg ) + skip;
+            sg_dma_len( out ) = seg;
+            out->length = seg;
+
+            skip += seg;
+            len -= seg;
+            left -= seg;
+
+            if ( 0 == left )
+            {
+                sg_mark_end( out );
+                return 0;
+            }
+            out = sg_next( out );
+        }
+
+        skip = 0;
+    }
+
+    return 0;
+}
+
+// Hand the first len bytes of a slice of a registered buffer over to the
+// device, or back to the cpu.
+static void udma_buf_sync_slice( struct udma_buf * buf, struct sg_table * slice, bool for_cpu, size_t len )
+{
+    struct scatterlist * sg;
+    int i;
+
+    if ( buf->coherent )
+        return;
+
+    for_each_sg( slice->sgl, sg, slice->nents, i )
+    {
+        const size_t seg = min_t( size_t, len, sg_dma_len(sg) );
+
+        if ( !seg )
+            break;
+
+        if ( for_cpu )
+            dma_sync_single_for_cpu( buf->dma_dev, sg_dma_address(sg), seg, buf->dma_dir );
+        else
+            dma_sync_single_for_device( buf->dma_dev, sg_dma_address(sg), seg, buf->dma_dir );
+
+        len -= seg;
+    }
+}
+
+/* Hand [offset, offset+len) of a buffer to the cpu or the device, for
+ * UDMA_IOC_SYNC.  dir can be narrower than a bidirectional buffer's: a
+ * range the cpu only wrote needn't be invalidated on the way back.
+ */
+static void udma_buf_sync_range( struct udma_buf * buf, size_t offset, size_t len, bool for_cpu,
+                                 enum dma_data_direction dir )
+{
+    struct scatterlist * sg;
+    int i;
+
+    if ( buf->dma_dir != DMA_BIDIRECTIONAL )
+        dir = buf->dma_dir;
+
+    for_each_sg( buf->table.sgl, sg, buf->nents, i )
+    {
+        size_t seg = sg_dma_len( sg );
+
+        if ( offset >= seg )
+        {
+            offset -= seg;
+            continue;
+        }
+
+        seg = min( seg - offset, len );
+        if ( for_cpu )
+            dma_sync_single_for_cpu( buf->dma_dev, sg_dma_address(sg) + offset, seg, dir );
+        else
+            dma_sync_single_for_device( buf->dma_dev, sg_dma_address(sg) + offset, seg, dir );
+
+        offset = 0;
+        len -= seg;
+        if ( !len )
+            break;
+    }
+}
+
+// Remember which pages of a registered RX buffer the device wrote, for udma_buf_release().
+static void udma_buf_mark_dirty( struct udma_buf * buf, size_t offset, size_t len )
+{
+    unsigned long pg, last;
+
+    if ( !buf->dirty || !len )
+        return;
+
+    pg = (buf->page_offset + offset) >> PAGE_SHIFT;
+    last = (buf->page_offset + offset + len - 1) >> PAGE_SHIFT;
+
+    for ( ; pg <= last; ++pg )
+        set_bit( pg, buf->dirty );
+}
+
+// Registered buffers
+
+static void udma_buf_release( struct kref * ref )
+{
+    struct udma_buf * buf = container_of( ref, struct udma_buf, ref );
+    unsigned int i;
+
+    if ( UDMA_BUF_DMABUF == buf->type )
+    {
+        dma_buf_unmap_attachment( buf->attach, buf->sgt, buf->dma_dir );
+        dma_buf_detach( buf->dmabuf, buf->attach );
+        dma_buf_put( buf->dmabuf );
+        kfree( buf );
+        return;
+    }
+
+    dma_unmap_sg( buf->dma_dev, buf->table.sgl, buf->table.nents, buf->dma_dir );
+
+    for ( i = 0; i < buf->num_pages; ++i )
+    {
+        // Only pages some RX transfer actually landed in.
+        if ( buf->dirty && test_bit( i, buf->dirty ) )
+            set_page_dirty_lock( buf->pinned_pages[i] );
+        put_page( buf->pinned_pages[i] );
+    }
+
+    sg_free_table( &buf->table );
+    kvfree( buf->dirty );
+    kvfree( buf->pinned_pages );
+    kfree( buf );
+}
+
+static struct udma_buf * udma_buf_register(
+        struct device * dev,
+        unsigned long uaddr,
+        size_t len,
+        uint32_t dir,
+        unsigned int max_seg
+)
+{
+    struct udma_buf * buf;
+    int pinned = 0;
+    int rv;
+
+    buf = kzalloc( sizeof(*buf), GFP_KERNEL );
+    if ( !buf )
+        return ERR_PTR(-ENOMEM);
+
+    kref_init( &buf->ref );
+    buf->dir = dir;
+    buf->dma_dir = udma_dma_dir( dir );
+    buf->size = len;
+    buf->dma_dev = dev;
+    buf->page_offset = offset_in_page(uaddr);
+    buf->num_pages = (offset_in_page(uaddr) + len + PAGE_SIZE-1) / PAGE_SIZE;
+
+    // Registered buffers can be big, don't insist on a contiguous page array.
+    buf->pinned_pages = kmalloc_array( buf->num_pages, sizeof(struct page*), GFP_KERNEL | __GFP_NOWARN );
+    if ( !buf->pinned_pages )
+        buf->pinned_pages = vmalloc( buf->num_pages * sizeof(struct page*) );
+
+    if ( !buf->pinned_pages )
+    {
+        rv = -ENOMEM;
+        goto err_out;
+    }
+
+    if ( dir & UDMA_DIR_RX )
+    {
+        const size_t dirty_size = BITS_TO_LONGS( buf->num_pages ) * sizeof(unsigned long);
+
+        buf->dirty = kzalloc( dirty_size, GFP_KERNEL | __GFP_NOWARN );
+        if ( !buf->dirty )
+            buf->dirty = vzalloc( dirty_size );
+
+        if ( !buf->dirty )
+        {
+            rv = -ENOMEM;
+            goto err_free_pages;
+        }
+    }
+
+    if ( (rv = sg_alloc_table( &buf->table, buf->num_pages, GFP_KERNEL )) )
+        goto err_free_pages;
+
+    pinned = get_user_pages_fast( uaddr, buf->num_pages, dir & UDMA_DIR_RX, buf->pinned_pages );
+
+    if ( pinned != buf->num_pages )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": get_user_pages_fast() returned %d, expected %d\n",
+                pinned, buf->num_pages);
+        rv = pinned < 0 ? pinned : -EFAULT;
+        goto err_unpin;
+    }
+
+    udma_fill_sgl( &buf->table, buf->pinned_pages, buf->num_pages, offset_in_page(uaddr), len, max_seg );
+
+    buf->nents = dma_map_sg( dev, buf->table.sgl, buf->table.nents, buf->dma_dir );
+
+    if ( !buf->nents )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": dma_map_sg() failed for %u entries\n", buf->table.nents);
+        rv = -ENOMEM;
+        goto err_unpin;
+    }
+
+    return buf;
+
+    err_unpin:
+    while ( pinned > 0 )
+        put_page( buf->pinned_pages[--pinned] );
+    sg_free_table( &buf->table );
+
+    err_free_pages:
+    kvfree( buf->dirty );
+    kvfree( buf->pinned_pages );
+
+    err_out:
+    kfree( buf );
+    return ERR_PTR(rv);
+}
+
+/* Attach a dma-buf to dev and have its exporter map it.  Its memory is the
+ * exporter's to keep coherent, around the CPU accesses it brackets with
+ * begin/end_cpu_access, so udma leaves it alone like a coherent buffer.
+ */
+static struct udma_buf * udma_buf_import( struct device * dev, int fd, uint32_t dir )
+{
+    struct udma_buf * buf;
+    int rv;
+
+    buf = kzalloc( sizeof(*buf), GFP_KERNEL );
+    if ( !buf )
+        return ERR_PTR(-ENOMEM);
+
+    kref_init( &buf->ref );
+    buf->type = UDMA_BUF_DMABUF;
+    buf->dir = dir;
+    buf->dma_dir = udma_dma_dir( dir );
+    buf->dma_dev = dev;
+    buf->coherent = true;
+
+    buf->dmabuf = dma_buf_get( fd );
+    if ( IS_ERR(buf->dmabuf) )
+    {
+        rv = PTR_ERR(buf->dmabuf);
+        goto err_out;
+    }
+    buf->size = buf->dmabuf->size;
+
+    buf->attach = dma_buf_attach( buf->dmabuf, dev );
+    if ( IS_ERR(buf->attach) )
+    {
+        rv = PTR_ERR(buf->attach);
+        goto err_put;
+    }
+
+    buf->sgt = dma_buf_map_attachment( buf->attach, buf->dma_dir );
+    if ( IS_ERR_OR_NULL(buf->sgt) )
+    {
+        rv = buf->sgt ? PTR_ERR(buf->sgt) : -ENOMEM;
+        printk( KERN_ERR KBUILD_MODNAME ": dma_buf_map_attachment() returned %d\n", rv);
+        goto err_detach;
+    }
+
+    // Slicing only reads the mapped entries, a shallow copy does.
+    buf->table = *buf->sgt;
+    buf->nents = buf->sgt->nents;
+
+    return buf;
+
+    err_detach:
+    dma_buf_detach( buf->dmabuf, buf->attach );
+
+    err_put:
+    dma_buf_put( buf->dmabuf );
+
+    err_out:
+    kfree( buf );
+    return ERR_PTR(rv);
+}
+
+// Pool and huge buffers belong to the device, not to any file.
+static inline bool udma_buf_file_owned( struct udma_buf * buf )
+{
+    return UDMA_BUF_USER == buf->type || UDMA_BUF_DMABUF == buf->type;
+}
+
+static void udma_buf_put( struct udma_buf * buf )
+{
+    if ( udma_buf_file_owned( buf ) )
+        kref_put( &buf->ref, udma_buf_release );
+}
+
+static void udma_buf_get( struct udma_buf * buf )
+{
+    if ( udma_buf_file_owned( buf ) )
+        kref_get( &buf->ref );
+}
+
+// Look up a registered (or pool) buffer and take a reference on it for the caller.
+static struct udma_buf * udma_file_get_buf( struct udma_file * p_file, u32 handle, u32 flags )
+{
+    struct udma_pdev_drvdata * p_pdev_info = p_file->pdev_info;
+    struct udma_buf * buf;
+
+    if ( flags & UDMA_XFER_POOL )
+        return handle < p_pdev_info->pool_count ? &p_pdev_info->pool[handle].buf : NULL;
+    if ( flags & UDMA_XFER_HUGE )
+        return handle < p_pdev_info->huge_count ? &p_pdev_info->huge[handle].buf : NULL;
+
+    mutex_lock( &p_file->lock );
+    buf = idr_find( &p_file->bufs, handle );
+    if ( buf )
+        kref_get( &buf->ref );
+    mutex_unlock( &p_file->lock );
+
+    return buf;
+}
+
+// Give buf a handle in p_file; its reference passes to the file, and is dropped on failure.
+static int udma_file_add_buf( struct udma_file * p_file, struct udma_buf * buf )
+{
+    int rv;
+
+    mutex_lock( &p_file->lock );
+    rv = idr_alloc( &p_file->bufs, buf, 1, 0, GFP_KERNEL );
+    if ( rv > 0 )
+        buf->handle = rv;
+    mutex_unlock( &p_file->lock );
+
+    if ( rv < 0 )
+        kref_put( &buf->ref, udma_buf_release );
+
+    return rv;
+}
+
+// Take back a handle that never made it to userspace.
+static void udma_file_undo_buf( struct udma_file * p_file, struct udma_buf * buf )
+{
+    // Unless somebody already guessed the handle and unregistered it...
+    mutex_lock( &p_file->lock );
+    if ( idr_find( &p_file->bufs, buf->handle ) == buf )
+        idr_remove( &p_file->bufs, buf->handle );
+    else
+        buf = NULL;
+    mutex_unlock( &p_file->lock );
+
+    if ( buf )
+        kref_put( &buf->ref, udma_buf_release );
+}
+
+static long udma_ioctl_register( struct udma_file * p_file, void __user * argp )
+{
+    struct udma_region region;
+    struct udma_buf * buf;
+    int rv;
+
+    if ( copy_from_user( &region, argp, sizeof(region) ) )
+        return -EFAULT;
+
+    if ( !region.len || region.len > INT_MAX ||
+         !region.dir || (region.dir & ~UDMA_DIR_BOTH) )
+        return -EINVAL;
+
+    buf = udma_buf_register( &p_file->pdev_info->pdev->dev, region.addr, region.len, region.dir,
+                             p_file->pdev_info->max_seg_size );
+    if ( IS_ERR(buf) )
+        return PTR_ERR(buf);
+
+    if ( (rv = udma_file_add_buf( p_file, buf )) < 0 )
+        return rv;
+
+    region.handle = buf->handle;
+
+    if ( copy_to_user( argp, &region, sizeof(region) ) )
+    {
+        udma_file_undo_buf( p_file, buf );
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+static long udma_ioctl_import( struct udma_file * p_file, void __user * argp )
+{
+    struct udma_import req;
+    struct udma_buf * buf;
+    int rv;
+
+    if ( copy_from_user( &req, argp, sizeof(req) ) )
+        return -EFAULT;
+
+    if ( !req.dir || (req.dir & ~UDMA_DIR_BOTH) )
+        return -EINVAL;
+
+    buf = udma_buf_import( &p_file->pdev_info->pdev->dev, req.fd, req.dir );
+    if ( IS_ERR(buf) )
+        return PTR_ERR(buf);
+
+    if ( (rv = udma_file_add_buf( p_file, buf )) < 0 )
+        return rv;
+
+    req.handle = buf->handle;
+    req.len = buf->size;
+
+    if ( copy_to_user( argp, &req, sizeof(req) ) )
+    {
+        udma_file_undo_buf( p_file, buf );
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+static long udma_ioctl_sync( struct udma_file * p_file, void __user * argp )
+{
+    static const enum dma_data_direction dirs[] = {
+        [UDMA_SYNC_READ] = DMA_FROM_DEVICE,
+        [UDMA_SYNC_WRITE] = DMA_TO_DEVICE,
+        [UDMA_SYNC_RW] = DMA_BIDIRECTIONAL,
+    };
+    struct udma_sync req;
+    struct udma_buf * buf;
+    bool for_cpu;
+    long rv = 0;
+
+    if ( copy_from_user( &req, argp, sizeof(req) ) )
+        return -EFAULT;
+
+    if ( (req.sync & ~(UDMA_SYNC_RW | UDMA_SYNC_END)) || !(req.sync & UDMA_SYNC_RW) ||
+         (req.flags & ~(UDMA_XFER_POOL | UDMA_XFER_HUGE)) )
+        return -EINVAL;
+    for_cpu = !(req.sync & UDMA_SYNC_END);
+
+    buf = udma_file_get_buf( p_file, req.handle, req.flags );
+    if ( !buf )
+        return -ENOENT;
+
+    if ( req.offset > buf->size || req.len > buf->size - req.offset )
+        rv = -EINVAL;
+    else if ( UDMA_BUF_DMABUF == buf->type )
+        rv = for_cpu ? dma_buf_begin_cpu_access( buf->dmabuf, dirs[req.sync & UDMA_SYNC_RW] ) :
+                       dma_buf_end_cpu_access( buf->dmabuf, dirs[req.sync & UDMA_SYNC_RW] );
+    else if ( !buf->coherent && req.len )
+        udma_buf_sync_range( buf, req.offset, req.len, for_cpu, dirs[req.sync & UDMA_SYNC_RW] );
+
+    udma_buf_put( buf );
+    return rv;
+}
+
+static long udma_ioctl_unregister( struct udma_file * p_file, void __user * argp )
+{
+    struct udma_buf * buf;
+    u32 handle;
+
+    if ( get_user( handle, (u32 __user *)argp ) )
+        return -EFAULT;
+
+    mutex_lock( &p_file->lock );
+    buf = idr_find( &p_file->bufs, handle );
+    if ( buf )
+        idr_remove( &p_file->bufs, handle );
+    mutex_unlock( &p_file->lock );
+
+    if ( !buf )
+        return -ENOENT;
+
+    // In-flight transfers hold their own reference.
+    kref_put( &buf->ref, udma_buf_release );
+    return 0;
+}
+
+// Mapping cache
+
+static void udma_mcache_work( struct work_struct * work )
+{
+    struct udma_mcache * mc = container_of( work, struct udma_mcache, work );
+    struct udma_mcache_entry * e, * tmp;
+    LIST_HEAD( dead );
+
+    spin_lock( &mc->lock );
+    list_splice_init( &mc->dead, &dead );
+    spin_unlock( &mc->lock );
+
+    // Transfers still using a buffer hold their own reference.
+    list_for_each_entry_safe( e, tmp, &dead, node )
+    {
+        udma_buf_put( e->buf );
+        kfree( e );
+    }
+}
+
+// Called with mc->lock held.
+static void udma_mcache_drop_locked( struct udma_mcache * mc, struct udma_mcache_entry * e )
+{
+    list_move_tail( &e->node, &mc->dead );
+    mc->entries--;
+    mc->pinned -= e->len;
+}
+
+static void udma_mcache_invalidate( struct udma_mcache * mc, unsigned long start, unsigned long end )
+{
+    struct udma_mcache_entry * e, * tmp;
+    bool dropped = false;
+
+    spin_lock( &mc->lock );
+    mc->seq++;
+    list_for_each_entry_safe( e, tmp, &mc->lru, node )
+    {
+        if ( e->addr < end && start < e->addr + e->len )
+        {
+            udma_mcache_drop_locked( mc, e );
+            dropped = true;
+        }
+    }
+    spin_unlock( &mc->lock );
+
+    if ( dropped )
+        schedule_work( &mc->work );
+}
+
+static void udma_mcache_invalidate_range_start( struct mmu_notifier * mn, struct mm_struct * mm,
+                                                unsigned long start, unsigned long end )
+{
+    udma_mcache_invalidate( container_of( mn, struct udma_mcache, mn ), start, end );
+}
+
+static void udma_mcache_invalidate_page( struct mmu_notifier * mn, struct mm_struct * mm,
+                                         unsigned long address )
+{
+    udma_mcache_invalidate( container_of( mn, struct udma_mcache, mn ), address, address + PAGE_SIZE );
+}
+
+// The process is exiting, or the cache is being destroyed.
+static void udma_mcache_release( struct mmu_notifier * mn, struct mm_struct * mm )
+{
+    struct udma_mcache * mc = container_of( mn, struct udma_mcache, mn );
+
+    spin_lock( &mc->lock );
+    mc->released = true;
+    spin_unlock( &mc->lock );
+
+    udma_mcache_invalidate( mc, 0, ULONG_MAX );
+}
+
+static const struct mmu_notifier_ops udma_mcache_ops = {
+    .release                = udma_mcache_release,
+    .invalidate_page        = udma_mcache_invalidate_page,
+    .invalidate_range_start = udma_mcache_invalidate_range_start,
+};
+
+// Unregistering runs release() if the mm is still around, then waits for the work.
+static void udma_mcache_destroy( struct udma_mcache * mc )
+{
+    mmu_notifier_unregister( &mc->mn, mc->mm );
+    flush_work( &mc->work );
+    kfree( mc );
+}
+
+/* The calling process's cache for p_pdev_info, created on first use.  Caches
+ * of processes that have exited are reaped on the way.  The notifier holds
+ * on to the mm_struct, so a new process can't be mistaken for an old one.
+ */
+static struct udma_mcache * udma_mcache_find( struct udma_pdev_drvdata * p_pdev_info )
+{
+    struct mm_struct * mm = current->mm;
+    struct udma_mcache * mc, * tmp, * found = NULL;
+
+    mutex_lock( &p_pdev_info->mcache_lock );
+    list_for_each_entry_safe( mc, tmp, &p_pdev_info->mcaches, node )
+    {
+        if ( READ_ONCE(mc->released) )
+        {
+            list_del( &mc->node );
+            udma_mcache_destroy( mc );
+        }
+        else if ( mc->mm == mm )
+            found = mc;
+    }
+
+    if ( !found && (found = kzalloc( sizeof(*found), GFP_KERNEL )) )
+    {
+        found->pdev_info = p_pdev_info;
+        found->mm = mm;
+        found->mn.ops = &udma_mcache_ops;
+        spin_lock_init( &found->lock );
+        INIT_LIST_HEAD( &found->lru );
+        INIT_LIST_HEAD( &found->dead );
+        INIT_WORK( &found->work, udma_mcache_work );
+
+        if ( mmu_notifier_register( &found->mn, mm ) )
+        {
+            kfree( found );
+            found = NULL;
+        }
+        else
+            list_add( &found->node, &p_pdev_info->mcaches );
+    }
+    mutex_unlock( &p_pdev_info->mcache_lock );
+
+    return found;
+}
+
+/* A cached buffer covering count bytes at uaddr for p_info's direction,
+ * with a reference for the caller and *p_offset set to where the range
+ * starts in it.  On a miss the range is registered and added, evicting
+ * the least recently used entries over the map_cache* limits.  NULL if
+ * the range isn't cached and can't be, udma_prepare_for_dma() then pins
+ * it for the one transfer (and reports why that fails, if it does).
+ */
+static struct udma_buf * udma_mcache_get( struct udma_drvdata * p_info, unsigned long uaddr,
+                                          size_t count, size_t * p_offset )
+{
+    struct udma_pdev_drvdata * p_pdev_info = p_info->pdev_info;
+    const size_t max_pinned = (size_t)map_cache_mb << 20;
+    struct udma_mcache * mc;
+    struct udma_mcache_entry * e, * tmp;
+    struct udma_buf * buf;
+    unsigned long seq;
+    bool dropped = false;
+
+    if ( !map_cache || !current->mm || count > max_pinned )
+        return NULL;
+
+    mc = udma_mcache_find( p_pdev_info );
+    if ( !mc )
+        return NULL;
+
+    spin_lock( &mc->lock );
+    list_for_each_entry( e, &mc->lru, node )
+    {
+        if ( e->dir == p_info->dir && e->addr <= uaddr && uaddr + count <= e->addr + e->len )
+        {
+            list_move( &e->node, &mc->lru );
+            buf = e->buf;
+            udma_buf_get( buf );
+            spin_unlock( &mc->lock );
+
+            *p_offset = uaddr - e->addr;
+            return buf;
+        }
+    }
+    seq = mc->seq;
+    spin_unlock( &mc->lock );
+
+    e = kzalloc( sizeof(*e), GFP_KERNEL );
+    if ( !e )
+        return NULL;
+
+    buf = udma_buf_register( &p_pdev_info->pdev->dev, uaddr, count, p_info->dir, p_pdev_info->max_seg_size );
+    if ( IS_ERR(buf) )
+    {
+        kfree( e );
+        return NULL;
+    }
+
+    e->addr = uaddr;
+    e->len = count;
+    e->dir = p_info->dir;
+    e->buf = buf;
+    *p_offset = 0;
+
+    spin_lock( &mc->lock );
+
+    // Something was unmapped while the pages were being pinned, they may be stale already.
+    if ( mc->seq != seq || mc->released )
+    {
+        spin_unlock( &mc->lock );
+        kfree( e );
+        return buf;     // good for this transfer, which pinned it before the change
+    }
+
+    list_add( &e->node, &mc->lru );
+    mc->entries++;
+    mc->pinned += count;
+    udma_buf_get( buf );
+
+    list_for_each_entry_safe_reverse( e, tmp, &mc->lru, node )
+    {
+        if ( mc->entries <= map_cache && mc->pinned <= max_pinned )
+            break;
+        udma_mcache_drop_locked( mc, e );
+        dropped = true;
+    }
+    spin_unlock( &mc->lock );
+
+    if ( dropped )
+        schedule_work( &mc->work );
+
+    return buf;
+}
+
+static void udma_mcache_teardown( struct udma_pdev_drvdata * p_pdev_info )
+{
+    struct udma_mcache * mc, * tmp;
+
+    mutex_lock( &p_pdev_info->mcache_lock );
+    list_for_each_entry_safe( mc, tmp, &p_pdev_info->mcaches, node )
+    {
+        list_del( &mc->node );
+        udma_mcache_destroy( mc );
+    }
+    mutex_unlock( &p_pdev_info->mcache_lock );
+}
+
+// Transfers
+
+static void udma_xfer_pool_ctx_free( struct udma_inflight_info * p_xfer )
+{
+    if ( p_xfer->pool_table.sgl )
+        sg_free_table( &p_xfer->pool_table );
+    kfree( p_xfer->pool_page_array );
+    kfree( p_xfer );
+}
+
+// Fill the channel's pool with xfer_pool contexts; fewer, if memory is short, is fine.
+static void udma_xfer_pool_init( struct udma_drvdata * p_info )
+{
+    const unsigned int pages = DIV_ROUND_UP( xfer_pool_size, PAGE_SIZE ) + 1;  // +1: unaligned start
+    unsigned int i;
+
+    for ( i = 0; xfer_pool_size && i < xfer_pool; ++i )
+    {
+        struct udma_inflight_info * p_xfer = kzalloc( sizeof(*p_xfer), GFP_KERNEL );
+
+        if ( !p_xfer )
+            break;
+
+        p_xfer->pooled = true;
+        p_xfer->pool_pages = pages;
+        p_xfer->pool_page_array = kmalloc_array( pages, sizeof(struct page*), GFP_KERNEL );
+        if ( !p_xfer->pool_page_array || sg_alloc_table( &p_xfer->pool_table, pages, GFP_KERNEL ) )
+        {
+            udma_xfer_pool_ctx_free( p_xfer );
+            break;
+        }
+
+        list_add_tail( &p_xfer->node, &p_info->xfer_pool );
+    }
+
+    if ( i < xfer_pool )
+        printk( KERN_WARNING KBUILD_MODNAME ": %s: only %u of %u transfer contexts preallocated\n",
+                p_info->name, i, xfer_pool);
+}
+
+// Free the idle contexts; ones still in use are freed when they come back.
+static void udma_xfer_pool_close( struct udma_drvdata * p_info )
+{
+    struct udma_inflight_info * p_xfer, * tmp;
+    LIST_HEAD( idle );
+
+    spin_lock( &p_info->xfer_pool_lock );
+    p_info->xfer_pool_closed = true;
+    list_splice_init( &p_info->xfer_pool, &idle );
+    spin_unlock( &p_info->xfer_pool_lock );
+
+    list_for_each_entry_safe( p_xfer, tmp, &idle, node )
+        udma_xfer_pool_ctx_free( p_xfer );
+}
+
+static struct udma_inflight_info * udma_xfer_alloc( struct udma_drvdata * p_info )
+{
+    struct udma_inflight_info * p_xfer;
+
+    spin_lock( &p_info->xfer_pool_lock );
+    p_xfer = list_first_entry_or_null( &p_info->xfer_pool, struct udma_inflight_info, node );
+    if ( p_xfer )
+        list_del( &p_xfer->node );
+    spin_unlock( &p_info->xfer_pool_lock );
+
+    if ( p_xfer )
+    {
+        // Start from scratch, but for the preallocated parts.
+        const unsigned int pages = p_xfer->pool_pages;
+        struct page ** const page_array = p_xfer->pool_page_array;
+        const struct sg_table table = p_xfer->pool_table;
+
+        memset( p_xfer, 0, sizeof(*p_xfer) );
+        p_xfer->pooled = true;
+        p_xfer->pool_pages = pages;
+        p_xfer->pool_page_array = page_array;
+        p_xfer->pool_table = table;
+    }
+    else
+    {
+        p_xfer = kzalloc( sizeof(*p_xfer), GFP_KERNEL );
+        if ( !p_xfer )
+            return NULL;
+    }
+
+    INIT_LIST_HEAD( &p_xfer->node );
+    INIT_LIST_HEAD( &p_xfer->iocb_node );
+    p_xfer->p_info = p_info;
+    p_xfer->state = DMA_IDLE;
+
+    return p_xfer;
+}
+
+// Undo whatever udma_prepare_*_for_dma() got done.  Process context, and the
+// transfer must not be in flight any more.
+static void udma_unprepare_after_dma( struct udma_inflight_info * p_xfer )
+{
+    struct udma_drvdata * p_info = p_xfer->p_info;
+    const bool rx_done = p_xfer->dma_started && p_info->dir == UDMA_DEV_TO_CPU;
+
+    trace_udma_unprepare( p_xfer );
+
+    if ( p_xfer->dma_mapped )
+    {
+        dma_unmap_sg(&p_info->pdev->dev,
+                p_xfer->table.sgl,
+                p_xfer->table.nents,
+                p_info->dir == UDMA_DEV_TO_CPU ? DMA_FROM_DEVICE : DMA_TO_DEVICE);
+    }
+    p_xfer->dma_mapped = 0;
+
+    if ( p_xfer->pages_pinned )
+    {
+        int i;
+
+        // p_xfer->len is what the device actually wrote, only those pages need writing back.
+        // Pages of several iovecs don't line up with it, those are all written back.
+        const unsigned int touched = !rx_done ? 0 : p_xfer->iov ? p_xfer->num_pages :
+            DIV_ROUND_UP( p_xfer->page_offset + p_xfer->len, PAGE_SIZE );
+
+        for (i = 0; i < p_xfer->num_pages; ++i)
+        {
+            struct page * const page = p_xfer->pinned_pages[i];
+
+            if ( i < touched )
+                set_page_dirty_lock( page );
+            put_page( page );
+        }
+    }
+    p_xfer->pages_pinned = 0;
+
+    // A registered buffer stays mapped, just give the slice back to the cpu.
+    if ( p_xfer->buf )
+    {
+        if ( rx_done )
+        {
+            if ( !p_xfer->nosync )
+                udma_buf_sync_slice( p_xfer->buf, &p_xfer->table, true, p_xfer->len );
+            udma_buf_mark_dirty( p_xfer->buf, p_xfer->buf_offset, p_xfer->len );
+        }
+        udma_buf_put( p_xfer->buf );
+        p_xfer->buf = NULL;
+    }
+
+    if ( p_xfer->table_allocated )
+        udma_table_put( &p_xfer->table, &p_xfer->pool_table );
+    p_xfer->table_allocated = 0;
+
+    if ( p_xfer->pinned_pages )
+    {
+        if ( p_xfer->pinned_pages != p_xfer->pool_page_array )
+            kfree(p_xfer->pinned_pages);
+        p_xfer->pinned_pages = NULL;
+    }
+}
+
+static void udma_xfer_free( struct udma_inflight_info * p_xfer )
+{
+    struct udma_drvdata * p_info = p_xfer->p_info;
+
+    udma_unprepare_after_dma( p_xfer );
+
+    if ( p_xfer->pooled )
+    {
+        spin_lock( &p_info->xfer_pool_lock );
+        if ( !p_info->xfer_pool_closed )
+        {
+            list_add( &p_xfer->node, &p_info->xfer_pool );  // hot in cache, use it next
+            p_xfer = NULL;
+        }
+        spin_unlock( &p_info->xfer_pool_lock );
+
+        if ( p_xfer )
+            udma_xfer_pool_ctx_free( p_xfer );
+        return;
+    }
+
+    kfree( p_xfer );
+}
+
+/* Map the table of pinned pages.  An IOMMU may merge entries further, so
+ * the dmaengine gets however many mapped segments come back.
+ */
+static int udma_map_for_dma( struct udma_inflight_info * p_xfer )
+{
+    struct udma_drvdata * p_info = p_xfer->p_info;
+    int rv;
+
+    rv = dma_map_sg(&p_info->pdev->dev,
+                p_xfer->table.sgl,
+                p_xfer->table.nents,
+                p_info->dir == UDMA_DEV_TO_CPU ? DMA_FROM_DEVICE : DMA_TO_DEVICE);
+
+    if ( rv <= 0 )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": %s: dma_map_sg() failed for %u entries\n", 
+                p_info->name, p_xfer->table.nents);
+        return -ENOMEM;
+    }
+    p_xfer->dma_mapped = 1;
+    p_xfer->nents = rv;
+    trace_udma_mapped( p_xfer );
+
+    return 0;
+}
+
+// Pin and map count bytes at userbuf.  On error the caller frees p_xfer.
+static int udma_prepare_for_dma(
+        struct udma_inflight_info * p_xfer,
+        char __user *userbuf,
+        size_t count
+)
+{
+    struct udma_drvdata * p_info = p_xfer->p_info;
+    struct udma_buf * buf;
+    size_t offset;
+    int pinned;
+    int rv;
+
+    // Seen recently: already pinned and mapped, only a slice to build.
+    if ( (buf = udma_mcache_get( p_info, (unsigned long)userbuf, count, &offset )) )
+    {
+        rv = udma_prepare_buf_for_dma( p_xfer, buf, offset, count );
+        udma_buf_put( buf );
+        return rv;
+    }
+
+    p_xfer->len = count;
+    p_xfer->page_offset = offset_in_page(userbuf);
+    p_xfer->num_pages = (offset_in_page(userbuf) + count + PAGE_SIZE-1) / PAGE_SIZE;
+    if ( p_xfer->num_pages <= p_xfer->pool_pages )
+        p_xfer->pinned_pages = p_xfer->pool_page_array;
+    else
+        p_xfer->pinned_pages = kmalloc( 
+            p_xfer->num_pages * sizeof(struct page*),
+            GFP_KERNEL);
+
+    if ( !p_xfer->pinned_pages )
+        return -ENOMEM;
+
+    if ( (rv = udma_table_get(
+                    &p_xfer->table, 
+                    &p_xfer->pool_table,
+                    p_xfer->num_pages )) )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": %s: sg_alloc_table() returned %d\n", 
+                p_info->name, rv);
+        return rv;
+    }
+    p_xfer->table_allocated = 1;
+
+    pinned = get_user_pages_fast(
+            (unsigned long)userbuf,             // start
+            p_xfer->num_pages,
+            p_info->dir == UDMA_DEV_TO_CPU,    // write
+            p_xfer->pinned_pages);
+
+    if ( pinned != p_xfer->num_pages )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": %s: get_user_pages_fast() returned %d, expected %d\n",
+                p_info->name, pinned, p_xfer->num_pages);
+
+        // Don't leak a partial pin.
+        rv = pinned < 0 ? pinned : -EFAULT;
+        while ( pinned > 0 )
+            put_page( p_xfer->pinned_pages[--pinned] );
+        return rv;
+    }
+    p_xfer->pages_pinned = 1;
+    trace_udma_pinned( p_xfer );
+
+    udma_fill_sgl(
+            &p_xfer->table,
+            p_xfer->pinned_pages,
+            p_xfer->num_pages,
+            offset_in_page(userbuf),
+            count,
+            p_info->max_seg_size );
+
+    return udma_map_for_dma( p_xfer );
+}
+
+/* Like udma_prepare_for_dma(), for count bytes of a readv()/writev() that
+ * start skip bytes into the first of the iovecs.  All of them are pinned,
+ * their pages back to back in pinned_pages, and go into one table so that
+ * the engine moves them as a single transaction.
+ */
+static int udma_prepare_iov_for_dma(
+        struct udma_inflight_info * p_xfer,
+        const struct iovec * iov,
+        size_t skip,
+        size_t count
+)
+{
+    struct udma_drvdata * p_info = p_xfer->p_info;
+    struct scatterlist * sg = NULL;
+    struct scatterlist * next;
+    const struct iovec * v;
+    unsigned int total_pages = 0;
+    unsigned int nents = 0;
+    size_t left, s;
+    int rv;
+
+    for ( v = iov, s = skip, left = count; left; ++v, s = 0 )
+    {
+        const size_t len = min( v->iov_len - s, left );
+
+        if ( len )
+            total_pages += DIV_ROUND_UP( offset_in_page((uintptr_t)v->iov_base + s) + len, PAGE_SIZE );
+        left -= len;
+    }
+
+    p_xfer->len = count;
+    p_xfer->iov = true;
+    if ( total_pages <= p_xfer->pool_pages )
+        p_xfer->pinned_pages = p_xfer->pool_page_array;
+    else
+        p_xfer->pinned_pages = kmalloc( total_pages * sizeof(struct page*), GFP_KERNEL );
+
+    if ( !p_xfer->pinned_pages )
+        return -ENOMEM;
+
+    if ( (rv = udma_table_get( &p_xfer->table, &p_xfer->pool_table, total_pages )) )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": %s: sg_alloc_table() returned %d\n",
+                p_info->name, rv);
+        return rv;
+    }
+    p_xfer->table_allocated = 1;
+    next = p_xfer->table.sgl;
+
+    // num_pages counts what is pinned so far, for udma_unprepare_after_dma() to let go of.
+    for ( v = iov, s = skip, left = count; left; ++v, s = 0 )
+    {
+        const size_t len = min( v->iov_len - s, left );
+        const unsigned long addr = (uintptr_t)v->iov_base + s;
+        struct page ** pages = p_xfer->pinned_pages + p_xfer->num_pages;
+        int num, pinned;
+
+        if ( !len )
+            continue;
+
+        num = DIV_ROUND_UP( offset_in_page(addr) + len, PAGE_SIZE );
+        pinned = get_user_pages_fast( addr, num, p_info->dir == UDMA_DEV_TO_CPU, pages );
+
+        if ( pinned != num )
+        {
+            printk( KERN_ERR KBUILD_MODNAME ": %s: get_user_pages_fast() returned %d, expected %d\n",
+                    p_info->name, pinned, num);
+
+            rv = pinned < 0 ? pinned : -EFAULT;
+            while ( pinned > 0 )
+                put_page( pages[--pinned] );
+            return rv;
+        }
+        p_xfer->num_pages += num;
+        p_xfer->pages_pinned = 1;
+
+        nents += udma_fill_sg_range( &sg, &next, pages, num, offset_in_page(addr), len,
+                                     p_info->max_seg_size );
+        left -= len;
+    }
+    trace_udma_pinned( p_xfer );
+
+    sg_mark_end( sg );
+    p_xfer->table.nents = nents;
+
+    return udma_map_for_dma( p_xfer );
+}
+
+// Like udma_prepare_for_dma(), but the pages were already pinned and mapped
+// when buf was registered, so only a slice of its table has to be built.
+static int udma_prepare_buf_for_dma(
+        struct udma_inflight_info * p_xfer,
+        struct udma_buf * buf,
+        size_t offset,
+        size_t count
+)
+{
+    int rv;
+
+    p_xfer->len = count;
+    p_xfer->buf_offset = offset;
+
+    if ( (rv = udma_buf_slice( buf, offset, count, p_xfer->p_info->max_seg_size,
+                               &p_xfer->table, &p_xfer->pool_table )) )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": %s: udma_buf_slice() returned %d\n",
+                p_xfer->p_info->name, rv);
+        return rv;
+    }
+    p_xfer->table_allocated = 1;
+    p_xfer->nents = p_xfer->table.nents;
+    trace_udma_mapped( p_xfer );
+
+    udma_buf_get( buf );
+    p_xfer->buf = buf;
+
+    if ( !p_xfer->nosync )
+        udma_buf_sync_slice( buf, &p_xfer->table, false, count );
+
+    return 0;
+}
+
+/* Called with p_info->state_lock held, from the dmaengine callback or when
+ * aborting.  Submitted transfers move to their file's done list to be
+ * reaped, iter transfers count down their udma_iocb, blocking callers
+ * just get woken up.
+ */
+static void udma_xfer_complete_locked( struct udma_inflight_info * p_xfer, int status )
+{
+    struct udma_drvdata * p_info = p_xfer->p_info;
+    struct udma_file * p_file = p_xfer->owner;
+    struct udma_iocb * p_iocb = p_xfer->iocb;
+
+    p_xfer->state = DMA_COMPLETING;
+    p_xfer->status = status;
+    trace_udma_complete( p_xfer, status );
+    list_del_init( &p_xfer->node );
+    p_info->num_inflight--;
+
+    if ( !status )
+    {
+        this_cpu_inc( p_info->stats->transfers );
+        this_cpu_add( p_info->stats->bytes, p_xfer->len );
+        udma_stat_hist( p_info, UDMA_HIST_SIZE, p_xfer->len );
+    }
+    else if ( -ECANCELED != status )
+        this_cpu_inc( p_info->stats->errors );
+    udma_stat_hist( p_info, UDMA_HIST_DMA, local_clock() - p_xfer->submit_ns );
+
+    if ( p_file )
+    {
+        spin_lock( &p_file->done_lock );
+        list_add_tail( &p_xfer->node, &p_file->done_list );
+        p_file->num_inflight--;
+        spin_unlock( &p_file->done_lock );
+        wake_up( &p_file->wq );     // release waits uninterruptibly
+    }
+
+    // Don't touch p_iocb once pending hits zero, its owner may free it.
+    if ( p_iocb )
+    {
+        struct kiocb * iocb = p_iocb->iocb;
+
+        if ( atomic_dec_and_test( &p_iocb->pending ) && iocb )
+            schedule_work( &p_iocb->work );
+    }
+
+    wake_up_interruptible( &p_info->wq );
+}
+
+/* Complete the transfers queued ahead of upto that were submitted without
+ * an interrupt (and so without a callback) of their own.  The channel runs
+ * descriptors in cookie order, which is inflight_list order, so upto's
+ * callback means they are done too; only if upto failed is each one asked.
+ * upto NULL means the whole list, as far as the engine has got.  Returns
+ * true if unsignalled transfers are left that nothing else will complete.
+ */
+static bool udma_reap_unsignalled_locked( struct udma_drvdata * p_info, struct udma_inflight_info * upto, int status )
+{
+    // Only a successful upto that is still queued vouches for what is ahead of it.
+    const bool upto_done = upto && !status && DMA_IN_FLIGHT == upto->state;
+    struct udma_inflight_info * p_xfer, * tmp;
+
+    list_for_each_entry_safe( p_xfer, tmp, &p_info->inflight_list, node )
+    {
+        enum dma_status tx_status;
+
+        if ( p_xfer == upto || p_xfer->irq )
+            break;
+
+        tx_status = DMA_COMPLETE;
+        if ( !upto_done )
+            tx_status = dma_async_is_tx_complete( p_info->chan, p_xfer->cookie, NULL, NULL );
+
+        if ( DMA_IN_PROGRESS == tx_status || DMA_PAUSED == tx_status )
+            break;
+
+        udma_xfer_complete_locked( p_xfer, DMA_COMPLETE == tx_status ? 0 : (status ? status : -EIO) );
+    }
+
+    return !list_empty( &p_info->inflight_list ) &&
+        !list_last_entry( &p_info->inflight_list, struct udma_inflight_info, node )->irq;
+}
+
+// Fallback for a batch that ended without an interrupt-raising descriptor.
+static enum hrtimer_restart udma_irq_timer_func( struct hrtimer * timer )
+{
+    struct udma_drvdata * p_info = container_of( timer, struct udma_drvdata, irq_timer );
+    unsigned long iflags;
+    bool again;
+
+    spin_lock_irqsave( &p_info->state_lock, iflags );
+    again = udma_reap_unsignalled_locked( p_info, NULL, 0 );
+    spin_unlock_irqrestore( &p_info->state_lock, iflags );
+
+    if ( !again )
+        return HRTIMER_NORESTART;
+
+    hrtimer_forward_now( timer, p_info->irq_timeout );
+    return HRTIMER_RESTART;
+}
+
+static void udma_dmaengine_callback_func(void *data, const struct dmaengine_result *result)
+{
+    struct udma_inflight_info * p_xfer = (struct udma_inflight_info*)data;
+    struct udma_drvdata * p_info = p_xfer->p_info;
+    unsigned long iflags;
+    int status;
+
+    switch ( result->result )
+    {
+    case DMA_TRANS_NOERROR:
+        status = 0;
+        break;
+    case DMA_TRANS_ABORTED:
+        status = -ECANCELED;
+        break;
+    default:
+        status = -EIO;
+        break;
+    }
+
+    spin_lock_irqsave(&p_info->state_lock, iflags);
+
+    if ( DMA_IN_FLIGHT == p_xfer->state )
+    {
+        /* An RX channel stops early at the end of a packet; the residue
+         * is what was left over.  Engines that don't report one leave it
+         * at 0, i.e. the whole transfer.
+         */
+        if ( !status && result->residue <= p_xfer->len )
+            p_xfer->len -= result->residue;
+
+        trace_udma_callback( p_xfer, status );
+        udma_reap_unsignalled_locked( p_info, p_xfer, status );
+        udma_xfer_complete_locked( p_xfer, status );
+    }
+    // else: well, nevermind then...
+    
+    spin_unlock_irqrestore(&p_info->state_lock, iflags);
+}
+
+/* Stop the channel and fail whatever was still queued on it with
+ * -ECANCELED.  The dmaengine can't terminate a single descriptor, so this
+ * hits every transfer on the channel, not just the caller's.
+ */
+static void udma_abort( struct udma_drvdata * p_info )
+{
+    struct udma_inflight_info * p_xfer, * tmp;
+    LIST_HEAD( aborted );
+
+    hrtimer_cancel( &p_info->irq_timer );
+    this_cpu_inc( p_info->stats->terminations );
+
+    spin_lock_irq( &p_info->state_lock );
+    dmaengine_terminate_async( p_info->chan );
+    list_splice_init( &p_info->inflight_list, &aborted );
+
+    // A late callback for one of them must leave it, and the list it is no longer on, alone.
+    list_for_each_entry( p_xfer, &aborted, node )
+        p_xfer->state = DMA_ABORTING;
+    spin_unlock_irq( &p_info->state_lock );
+
+    // Callbacks for descriptors that finished before the terminate may still be running.
+    dmaengine_synchronize( p_info->chan );
+
+    spin_lock_irq( &p_info->state_lock );
+    list_for_each_entry_safe( p_xfer, tmp, &aborted, node )
+        udma_xfer_complete_locked( p_xfer, -ECANCELED );
+    spin_unlock_irq( &p_info->state_lock );
+}
+
+// Queued, or being aborted: either way udma_xfer_complete_locked() is still to come.
+static inline bool udma_state_in_flight( enum dma_fsm_state state )
+{
+    return DMA_IN_FLIGHT == state || DMA_ABORTING == state;
+}
+
+static int check_not_in_flight( struct udma_inflight_info * p_xfer )
+{
+    int rv;
+    spin_lock_irq(&p_xfer->p_info->state_lock);
+    
+    rv = !udma_state_in_flight( p_xfer->state );
+    
+    spin_unlock_irq(&p_xfer->p_info->state_lock);
+
+    return rv;
+}
+
+/* Spin for up to budget_ns waiting for p_xfer's callback rather than
+ * sleeping on p_info->wq, which saves the wakeup and context switch.  Once
+ * the engine reports the cookie complete the callback is on its way, so
+ * the budget starts over once for it.  Returns true if p_xfer completed.
+ */
+static bool udma_busy_poll( struct udma_inflight_info * p_xfer, dma_cookie_t cookie, u64 budget_ns )
+{
+    struct udma_drvdata * p_info = p_xfer->p_info;
+    u64 deadline = local_clock() + budget_ns;
+    bool hw_done = false;
+
+    while ( udma_state_in_flight( READ_ONCE( p_xfer->state ) ) )
+    {
+        if ( need_resched() || signal_pending( current ) )
+            return false;
+
+        if ( !hw_done && DMA_IN_PROGRESS != dma_async_is_tx_complete( p_info->chan, cookie, NULL, NULL ) )
+        {
+            hw_done = true;
+            deadline = local_clock() + budget_ns;
+        }
+        else if ( local_clock() > deadline )
+            return false;
+
+        cpu_relax();
+    }
+
+    // Take the lock once, so that status and len are seen as the callback left them.
+    return check_not_in_flight( p_xfer );
+}
+
+static int check_slot_free( struct udma_drvdata * p_info )
+{
+    int rv;
+    spin_lock_irq(&p_info->state_lock);
+
+    rv = (p_info->num_inflight < p_info->max_inflight);
+
+    spin_unlock_irq(&p_info->state_lock);
+
+    return rv;
+}
+
+/* Queue a prepared transfer on its channel and kick it off, behind
+ * whatever is already queued there.  Waits for one of the channel's
+ * max_inflight slots unless nowait is set.  Returns the dmaengine cookie.
+ * Callers queueing several at once pass issue false and call
+ * dma_async_issue_pending() themselves after the last one.
+ *
+ * A batched transfer only gets a completion interrupt (and callback) if
+ * it is the channel's irq_every'th in a row without one; the callback of
+ * a later descriptor, or the irq timer, completes it otherwise.
+ */
+static dma_cookie_t udma_xfer_submit( struct udma_inflight_info * p_xfer, bool nowait, bool issue )
+{
+    struct udma_drvdata * p_info = p_xfer->p_info;
+    struct dma_async_tx_descriptor * txn_desc;
+    dma_cookie_t cookie;
+
+    // Reserve the slot up front, a prepared descriptor can't be handed back.
+    spin_lock_irq( &p_info->state_lock );
+    while ( p_info->num_inflight >= p_info->max_inflight )
+    {
+        spin_unlock_irq( &p_info->state_lock );
+
+        // What would free a slot may be queued but not yet issued.
+        dma_async_issue_pending( p_info->chan );
+
+        if ( nowait )
+            return -EAGAIN;
+        if ( wait_event_interruptible( p_info->wq, check_slot_free(p_info) ) )
+        {
+            this_cpu_inc( p_info->stats->interrupted );
+            return -ERESTARTSYS;
+        }
+
+        spin_lock_irq( &p_info->state_lock );
+    }
+    if ( p_info->cyclic_owner )
+    {
+        // The channel is looping over a ring, nothing else gets on it.
+        spin_unlock_irq( &p_info->state_lock );
+        return -EBUSY;
+    }
+    p_info->num_inflight++;
+    p_xfer->irq = !p_xfer->batched || ++p_info->since_irq >= p_info->irq_every;
+    if ( p_xfer->irq )
+        p_info->since_irq = 0;
+    spin_unlock_irq( &p_info->state_lock );
+
+    txn_desc = dmaengine_prep_slave_sg(
+            p_info->chan,
+            p_xfer->table.sgl,
+            p_xfer->nents,
+            p_info->dir == UDMA_DEV_TO_CPU ? DMA_DEV_TO_MEM : DMA_MEM_TO_DEV,
+            p_xfer->irq ? DMA_PREP_INTERRUPT : 0);  // run callback after this one
+
+    if ( !txn_desc )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": %s: dmaengine_prep_slave_sg() failed\n", p_info->name);
+        cookie = -ENOMEM;
+        goto err_out;
+    }
+
+    if ( p_xfer->irq )
+    {
+        txn_desc->callback_result = udma_dmaengine_callback_func;
+        txn_desc->callback_param = p_xfer;
+    }
+
+    spin_lock_irq( &p_info->state_lock );
+
+    p_xfer->submit_ns = local_clock();
+    cookie = dmaengine_submit(txn_desc);
+
+    if ( cookie < DMA_MIN_COOKIE )
+    {
+        spin_unlock_irq( &p_info->state_lock );
+        printk( KERN_ERR KBUILD_MODNAME ": %s: dmaengine_submit() returned %d\n", p_info->name, cookie);
+        goto err_out;
+    }
+
+    p_xfer->cookie = cookie;
+    p_xfer->state = DMA_IN_FLIGHT;
+    p_xfer->dma_started = 1;
+    list_add_tail( &p_xfer->node, &p_info->inflight_list );
+    trace_udma_submit( p_xfer );
+
+    if ( p_xfer->owner )
+    {
+        spin_lock( &p_xfer->owner->done_lock );
+        p_xfer->owner->num_inflight++;
+        spin_unlock( &p_xfer->owner->done_lock );
+    }
+
+    if ( issue )
+        dma_async_issue_pending( p_info->chan );    // Bam!
+
+    if ( !p_xfer->irq && !hrtimer_is_queued( &p_info->irq_timer ) )
+        hrtimer_start( &p_info->irq_timer, p_info->irq_timeout, HRTIMER_MODE_REL );
+
+    spin_unlock_irq( &p_info->state_lock );
+
+    return cookie;
+
+    err_out:
+    spin_lock_irq( &p_info->state_lock );
+    p_info->num_inflight--;
+    spin_unlock_irq( &p_info->state_lock );
+    wake_up_interruptible( &p_info->wq );
+
+    return cookie;
+}
+
+#define UDMA_XFER_FLAGS (UDMA_XFER_POOL | UDMA_XFER_NOWAIT | UDMA_XFER_CHAN | UDMA_XFER_HUGE | UDMA_XFER_MORE | \
+                         UDMA_XFER_NOSYNC)
+
+static struct udma_drvdata * udma_find_chan( struct udma_pdev_drvdata * p_pdev_info, u32 index )
+{
+    struct udma_drvdata * p_info;
+
+    list_for_each_entry( p_info, &p_pdev_info->udma_list, node )
+    {
+        if ( p_info->index == index )
+            return udma_chan_gone( p_info ) ? NULL : p_info;
+    }
+
+    return NULL;
+}
+
+// The channel named in the request, or the one the file uses for dir by default.
+static struct udma_drvdata * udma_file_chan( struct udma_file * p_file, uint32_t dir, const struct udma_xfer * req )
+{
+    struct udma_drvdata * p_info;
+
+    if ( req && (req->flags & UDMA_XFER_CHAN) )
+        p_info = udma_find_chan( p_file->pdev_info, req->chan );
+    else
+        p_info = READ_ONCE( dir == UDMA_DIR_RX ? p_file->rx_chan : p_file->tx_chan );
+
+    return p_info && !udma_chan_gone( p_info ) && p_info->dir == dir ? p_info : NULL;
+}
+
+/* Turn a transfer request into a prepared transfer on the right channel:
+ * a slice of a registered or pool buffer, or freshly pinned user pages.
+ */
+static struct udma_inflight_info * udma_xfer_from_req( struct udma_file * p_file, const struct udma_xfer * req )
+{
+    struct udma_drvdata * p_info;
+    struct udma_inflight_info * p_xfer;
+    struct udma_buf * buf = NULL;
+    u64 start;
+    int rv;
+
+    if ( (req->flags & ~UDMA_XFER_FLAGS) ||
+         (req->dir != UDMA_DIR_RX && req->dir != UDMA_DIR_TX) ||
+         !req->len || req->len > INT_MAX )
+        return ERR_PTR(-EINVAL);
+
+    p_info = udma_file_chan( p_file, req->dir, req );
+    if ( !p_info )
+        return ERR_PTR(-ENODEV);
+
+    if ( 0 != (req->len % UDMA_ALIGN_BYTES) )
+    {
+        printk( KERN_WARNING KBUILD_MODNAME ": %s: unaligned %s of %llu bytes requested\n",
+                p_info->name,
+                p_info->dir == UDMA_DEV_TO_CPU ? "read" : "write",
+                (unsigned long long)req->len);
+        return ERR_PTR(-EINVAL);
+    }
+
+    if ( !atomic_read(&p_info->accepting ) )
+        return ERR_PTR(-EBADF);
+
+    if ( req->handle || (req->flags & (UDMA_XFER_POOL | UDMA_XFER_HUGE)) )
+    {
+        buf = udma_file_get_buf( p_file, req->handle, req->flags );
+        if ( !buf )
+            return ERR_PTR(-ENOENT);
+
+        if ( !(buf->dir & req->dir) ||
+             req->offset > buf->size || req->len > buf->size - req->offset )
+        {
+            p_xfer = ERR_PTR(-EINVAL);
+            goto out;
+        }
+    }
+    else if ( req->flags & UDMA_XFER_NOSYNC )
+    {
+        return ERR_PTR(-EINVAL);    // dma_map_sg() of user pages always syncs
+    }
+
+    p_xfer = udma_xfer_alloc( p_info );
+    if ( !p_xfer )
+    {
+        p_xfer = ERR_PTR(-ENOMEM);
+        goto out;
+    }
+    p_xfer->nosync = req->flags & UDMA_XFER_NOSYNC;
+
+    start = local_clock();
+    if ( buf )
+        rv = udma_prepare_buf_for_dma( p_xfer, buf, req->offset, req->len );
+    else
+        rv = udma_prepare_for_dma( p_xfer, u64_to_user_ptr(req->addr), req->len );
+
+    if ( rv )
+    {
+        udma_xfer_free( p_xfer );
+        p_xfer = ERR_PTR(rv);
+    }
+    else
+        udma_stat_hist( p_info, UDMA_HIST_PREP, local_clock() - start );
+
+    out:
+    if ( buf )
+        udma_buf_put( buf );    // the transfer took its own reference
+    return p_xfer;
+}
+
+// The transfer for a whole readv()/writev() on p_info, see udma_prepare_iov_for_dma().
+static struct udma_inflight_info * udma_xfer_from_iter( struct udma_drvdata * p_info, struct iov_iter * iter )
+{
+    const size_t count = iov_iter_count( iter );
+    struct udma_inflight_info * p_xfer;
+    u64 start;
+    int rv;
+
+    if ( !count || count > INT_MAX || 0 != (count % UDMA_ALIGN_BYTES) )
+        return ERR_PTR(-EINVAL);
+
+    if ( !atomic_read(&p_info->accepting ) )
+        return ERR_PTR(-EBADF);
+
+    p_xfer = udma_xfer_alloc( p_info );
+    if ( !p_xfer )
+        return ERR_PTR(-ENOMEM);
+
+    start = local_clock();
+    rv = udma_prepare_iov_for_dma( p_xfer, iter->iov, iter->iov_offset, count );
+    if ( rv )
+    {
+        udma_xfer_free( p_xfer );
+        return ERR_PTR(rv);
+    }
+    udma_stat_hist( p_info, UDMA_HIST_PREP, local_clock() - start );
+
+    return p_xfer;
+}
+
+/* Wait for a submitted blocking transfer to complete, or abort the
+ * channel if a signal comes first.  Returns the number of bytes
+ * transferred or -errno; the transfer is left for the caller to free.
+ */
+static ssize_t udma_xfer_wait( struct udma_file * p_file, struct udma_inflight_info * p_xfer )
+{
+    struct udma_drvdata * p_info = p_xfer->p_info;
+    u64 budget_ns = READ_ONCE( p_file->busy_poll_ns );
+    int wait_rv = 0;
+
+    if ( budget_ns && udma_busy_poll( p_xfer, p_xfer->cookie, budget_ns ) )
+        atomic64_inc( &p_info->busy_poll_hits );
+    else
+    {
+        if ( budget_ns )
+            atomic64_inc( &p_info->busy_poll_fallbacks );
+        wait_rv = wait_event_interruptible( p_info->wq, check_not_in_flight(p_xfer) );
+    }
+    trace_udma_wakeup( p_xfer );
+
+    if ( wait_rv )
+        this_cpu_inc( p_info->stats->interrupted );
+
+    if ( wait_rv && !check_not_in_flight(p_xfer) )
+        udma_abort( p_info );
+
+    if ( wait_rv && -ECANCELED == p_xfer->status )
+        return wait_rv;
+    else if ( p_xfer->status )
+        return p_xfer->status;
+    else
+        return p_xfer->len;
+}
+
+/* Blocking transfer shared by read(), write() and UDMA_IOC_XFER: submit,
+ * wait for the completion and free the transfer.  Returns the number of
+ * bytes transferred.
+ */
+static ssize_t udma_xfer_run( struct udma_file * p_file, struct udma_inflight_info * p_xfer )
+{
+    dma_cookie_t cookie;
+    ssize_t rv;
+
+    cookie = udma_xfer_submit( p_xfer, false, true );
+    if ( cookie < DMA_MIN_COOKIE )
+        rv = cookie;
+    else
+        rv = udma_xfer_wait( p_file, p_xfer );
+
+    udma_xfer_free( p_xfer );
+    return rv;
+}
+
+// Prepare the chunk of userbuf at *p_offset, on channel p_info, and advance past it.
+static struct udma_inflight_info * udma_chunk_prepare( struct udma_file * p_file, struct udma_drvdata * p_info,
+        const char __user * userbuf, size_t count, size_t * p_offset, size_t * p_len )
+{
+    struct udma_xfer req = {
+        .addr   = (uintptr_t)userbuf + *p_offset,
+        .len    = min_t( size_t, count - *p_offset, chunk_size ),
+        .dir    = p_info->dir,
+        .flags  = UDMA_XFER_CHAN,   // a concurrent UDMA_IOC_SET_CHAN mustn't split the call
+        .chan   = p_info->index,
+    };
+    struct udma_inflight_info * p_xfer = udma_xfer_from_req( p_file, &req );
+
+    if ( !IS_ERR(p_xfer) )
+    {
+        *p_offset += req.len;
+        *p_len = req.len;
+    }
+    return p_xfer;
+}
+
+/* read()/write() of more than chunk_size bytes.  Pinning and mapping the
+ * whole buffer up front, and unmapping it all at the end, would leave the
+ * engine idle for a long time on either side, so go a chunk at a time:
+ * the next chunk is prepared while the current one is on the wire, and
+ * the current one is released while the next one moves.  TX queues the
+ * next chunk straight behind the current one; RX waits to see that the
+ * current one didn't end short, since a short packet ends the read.
+ * Returns the bytes transferred up to the first short or failed chunk.
+ */
+static ssize_t udma_transfer_chunked( struct udma_file * p_file, uint32_t dir, const char __user *userbuf, size_t count )
+{
+    struct udma_drvdata * p_info = udma_file_chan( p_file, dir, NULL );
+    struct udma_inflight_info * p_cur, * p_next;
+    size_t offset = 0, done = 0, cur_len = 0, next_len = 0;
+    bool complete = true;   // every chunk so far went through in full
+    dma_cookie_t cookie;
+    ssize_t rv = 0, len;
+
+    if ( !p_info )
+        return -ENODEV;
+
+    p_cur = udma_chunk_prepare( p_file, p_info, userbuf, count, &offset, &cur_len );
+    if ( IS_ERR(p_cur) )
+        return PTR_ERR(p_cur);
+
+    cookie = udma_xfer_submit( p_cur, false, true );
+    if ( cookie < DMA_MIN_COOKIE )
+    {
+        udma_xfer_free( p_cur );
+        return cookie;
+    }
+
+    while ( p_cur )
+    {
+        p_next = NULL;
+        if ( complete && offset < count )
+        {
+            p_next = udma_chunk_prepare( p_file, p_info, userbuf, count, &offset, &next_len );
+            if ( IS_ERR(p_next) )
+            {
+                rv = PTR_ERR(p_next);
+                p_next = NULL;
+                offset = count;
+            }
+        }
+
+        if ( p_next && UDMA_DIR_TX == dir )
+        {
+            cookie = udma_xfer_submit( p_next, false, true );
+            if ( cookie < DMA_MIN_COOKIE )
+            {
+                rv = cookie;
+                udma_xfer_free( p_next );
+                p_next = NULL;
+                offset = count;
+            }
+        }
+
+        len = udma_xfer_wait( p_file, p_cur );
+        if ( complete )
+        {
+            if ( len < 0 )
+            {
+                rv = len;
+                complete = false;
+            }
+            else
+            {
+                done += len;
+                complete = (len == cur_len);
+            }
+        }
+
+        if ( p_next && UDMA_DIR_RX == dir )
+        {
+            cookie = complete ? udma_xfer_submit( p_next, false, true ) : -ECANCELED;
+            if ( cookie < DMA_MIN_COOKIE )
+            {
+                udma_xfer_free( p_next );
+                p_next = NULL;
+                if ( complete )
+                    rv = cookie;
+            }
+        }
+
+        udma_xfer_free( p_cur );
+        p_cur = p_next;
+        cur_len = next_len;
+    }
+
+    return done ? done : rv;
+}
+
+/* write() of more than a stripe on a channel of a stripe group.  Stripes
+ * go to the group's channels in turn, in order, with up to two per channel
+ * in flight: while one moves, the next one is pinned and queued behind it.
+ * Returns the bytes written up to the first failed stripe.
+ */
+static ssize_t udma_transfer_striped( struct udma_file * p_file, struct udma_chan_group * group,
+                                      const char __user *userbuf, size_t count )
+{
+    const unsigned int window = 2 * group->num_chans;
+    struct udma_inflight_info * p_ring[2 * UDMA_GROUP_MAX_CHANS];
+    size_t len_ring[2 * UDMA_GROUP_MAX_CHANS];
+    unsigned int head = 0, tail = 0;    // stripes submitted and waited for
+    size_t offset = 0, done = 0;
+    bool submitting = true;     // no stripe has failed to go out
+    bool complete = true;       // every stripe waited for so far went through in full
+    struct udma_inflight_info * p_xfer;
+    dma_cookie_t cookie;
+    ssize_t rv = 0, len;
+
+    while ( tail != head || (submitting && offset < count) )
+    {
+        if ( submitting && offset < count && head - tail < window )
+        {
+            struct udma_xfer req = {
+                .addr   = (uintptr_t)userbuf + offset,
+                .len    = min_t( size_t, count - offset, group->stripe_size ),
+                .dir    = UDMA_DIR_TX,
+                .flags  = UDMA_XFER_CHAN,
+                .chan   = group->chans[head % group->num_chans]->index,
+            };
+
+            p_xfer = udma_xfer_from_req( p_file, &req );
+            if ( IS_ERR(p_xfer) )
+                cookie = PTR_ERR(p_xfer);
+            else if ( (cookie = udma_xfer_submit( p_xfer, false, true )) < DMA_MIN_COOKIE )
+                udma_xfer_free( p_xfer );
+
+            if ( cookie < DMA_MIN_COOKIE )
+            {
+                if ( complete )
+                    rv = cookie;
+                submitting = false;
+                continue;
+            }
+
+            p_ring[head % window] = p_xfer;
+            len_ring[head % window] = req.len;
+            head++;
+            offset += req.len;
+            continue;
+        }
+
+        // The window is full, or everything is out: wait for the oldest stripe.
+        p_xfer = p_ring[tail % window];
+        len = udma_xfer_wait( p_file, p_xfer );
+        if ( complete )
+        {
+            if ( len < 0 )
+                rv = len;
+            else
+                done += len;
+            complete = (len == len_ring[tail % window]);
+        }
+        if ( !complete )
+            submitting = false;
+
+        udma_xfer_free( p_xfer );
+        tail++;
+    }
+
+    return done ? done : rv;
+}
+
+static ssize_t udma_transfer( struct udma_file * p_file, uint32_t dir, const char __user *userbuf, size_t count )
+{
+    struct udma_xfer req = {
+        .addr   = (uintptr_t)userbuf,
+        .len    = count,
+        .dir    = dir,
+    };
+    struct udma_drvdata * p_info = udma_file_chan( p_file, dir, NULL );
+    struct udma_inflight_info * p_xfer;
+    u64 start = local_clock();
+    ssize_t rv;
+
+    if ( p_info )
+        trace_udma_call( p_info, count );
+
+    if ( p_info && p_info->group && count > p_info->group->stripe_size )
+        rv = udma_transfer_striped( p_file, p_info->group, userbuf, count );
+    else if ( chunk_size && count > chunk_size )
+        rv = udma_transfer_chunked( p_file, dir, userbuf, count );
+    else
+    {
+        p_xfer = udma_xfer_from_req( p_file, &req );
+        if ( IS_ERR(p_xfer) )
+            return PTR_ERR(p_xfer);
+
+        rv = udma_xfer_run( p_file, p_xfer );
+    }
+
+    udma_stat_call( p_info, start );
+    return rv;
+}
+
+ssize_t udma_read(struct udma_file *p_file, char __user *userbuf, size_t count)
+{
+    return udma_transfer( p_file, UDMA_DIR_RX, userbuf, count );
+}
+EXPORT_SYMBOL_GPL(udma_read);
+
+ssize_t udma_write(struct udma_file *p_file, const char __user *userbuf, size_t count)
+{
+    return udma_transfer( p_file, UDMA_DIR_TX, userbuf, count );
+}
+EXPORT_SYMBOL_GPL(udma_write);
+
+/* read_iter()/write_iter(): several iovecs go as one transfer over all of
+ * them; with vectored=N, as one transfer per segment, all queued at once.
+ */
+
+static ssize_t udma_iocb_finish( struct udma_iocb * p_iocb )
+{
+    struct udma_inflight_info * p_xfer, * tmp;
+    ssize_t rv = 0;
+    bool failed = false;
+
+    // Bytes up to the first failed segment, or its error if that was the first.
+    list_for_each_entry_safe( p_xfer, tmp, &p_iocb->xfers, iocb_node )
+    {
+        if ( !failed && p_xfer->status )
+        {
+            failed = true;
+            if ( !rv )
+                rv = p_xfer->status;
+        }
+        else if ( !failed )
+        {
+            rv += p_xfer->len;
+        }
+
+        list_del( &p_xfer->iocb_node );
+        udma_xfer_free( p_xfer );
+    }
+
+    kfree( p_iocb );
+    return rv;
+}
+
+// Unpinning may sleep, so async iocbs are completed from here rather than the callback.
+static void udma_iocb_work( struct work_struct * work )
+{
+    struct udma_iocb * p_iocb = container_of( work, struct udma_iocb, work );
+    struct kiocb * iocb = p_iocb->iocb;
+
+    iocb->ki_complete( iocb, udma_iocb_finish( p_iocb ), 0 );
+}
+
+static int check_iocb_done( struct udma_iocb * p_iocb )
+{
+    int rv;
+    spin_lock_irq(&p_iocb->p_info->state_lock);
+
+    rv = (0 == atomic_read( &p_iocb->pending ));
+
+    spin_unlock_irq(&p_iocb->p_info->state_lock);
+
+    return rv;
+}
+
+static ssize_t udma_transfer_iter( struct udma_file * p_file, uint32_t dir, struct kiocb * iocb, struct iov_iter * iter )
+{
+    struct udma_drvdata * p_info = udma_file_chan( p_file, dir, NULL );
+    struct udma_iocb * p_iocb;
+    const struct iovec * iov;
+    size_t skip, left;
+    bool nowait = false;
+    ssize_t rv = 0;
+    int wait_rv;
+
+    if ( !p_info )
+        return -ENODEV;
+
+    trace_udma_call( p_info, iov_iter_count( iter ) );
+
+    // Only user memory can be pinned here.
+    if ( !iter_is_iovec( iter ) )
+        return -EINVAL;
+
+#ifdef IOCB_NOWAIT
+    nowait = iocb->ki_flags & IOCB_NOWAIT;
+#endif
+
+    p_iocb = kzalloc( sizeof(*p_iocb), GFP_KERNEL );
+    if ( !p_iocb )
+        return -ENOMEM;
+
+    p_iocb->iocb = is_sync_kiocb( iocb ) ? NULL : iocb;
+    p_iocb->p_info = p_info;
+    INIT_LIST_HEAD( &p_iocb->xfers );
+    atomic_set( &p_iocb->pending, 1 );
+    INIT_WORK( &p_iocb->work, udma_iocb_work );
+
+    iov = iter->iov;
+    skip = iter->iov_offset;
+    left = iov_iter_count( iter );
+
+    // Several iovecs: one table over all of them, one descriptor chain, one completion.
+    if ( vectored && iter->nr_segs > 1 )
+    {
+        struct udma_inflight_info * p_xfer = udma_xfer_from_iter( p_info, iter );
+        dma_cookie_t cookie;
+
+        if ( IS_ERR(p_xfer) )
+        {
+            kfree( p_iocb );
+            return PTR_ERR(p_xfer);
+        }
+
+        p_xfer->iocb = p_iocb;
+        list_add_tail( &p_xfer->iocb_node, &p_iocb->xfers );
+        atomic_inc( &p_iocb->pending );
+
+        cookie = udma_xfer_submit( p_xfer, nowait, false );
+        if ( cookie < DMA_MIN_COOKIE )
+        {
+            list_del( &p_xfer->iocb_node );
+            udma_xfer_free( p_xfer );
+            kfree( p_iocb );
+            return cookie;
+        }
+
+        left = 0;
+    }
+
+    for ( ; left; ++iov, skip = 0 )
+    {
+        const size_t len = min( iov->iov_len - skip, left );
+        struct udma_xfer req = {
+            .addr   = (uintptr_t)iov->iov_base + skip,
+            .len    = len,
+            .dir    = dir,
+        };
+        struct udma_inflight_info * p_xfer;
+        dma_cookie_t cookie;
+
+        if ( !len )
+            continue;
+
+        p_xfer = udma_xfer_from_req( p_file, &req );
+        if ( IS_ERR(p_xfer) )
+        {
+            rv = PTR_ERR(p_xfer);
+            break;
+        }
+
+        // A concurrent UDMA_IOC_SET_CHAN must not split one call over two channels.
+        if ( p_xfer->p_info != p_info )
+        {
+            udma_xfer_free( p_xfer );
+            rv = -EAGAIN;
+            break;
+        }
+
+        p_xfer->iocb = p_iocb;
+        p_xfer->batched = len < left;   // only the last segment needs to interrupt
+        list_add_tail( &p_xfer->iocb_node, &p_iocb->xfers );
+        atomic_inc( &p_iocb->pending );
+
+        cookie = udma_xfer_submit( p_xfer, nowait, false );
+        if ( cookie < DMA_MIN_COOKIE )
+        {
+            atomic_dec( &p_iocb->pending );
+            list_del( &p_xfer->iocb_node );
+            udma_xfer_free( p_xfer );
+            rv = cookie;
+            break;
+        }
+
+        left -= len;
+    }
+
+    // Nothing queued: fail the whole call.  Otherwise later errors only shorten it.
+    if ( list_empty( &p_iocb->xfers ) )
+    {
+        kfree( p_iocb );
+        return rv;
+    }
+
+    dma_async_issue_pending( p_info->chan );
+
+    if ( p_iocb->iocb )
+    {
+        // Whoever drops the last reference to pending completes the iocb.
+        if ( atomic_dec_and_test( &p_iocb->pending ) )
+            schedule_work( &p_iocb->work );
+        return -EIOCBQUEUED;
+    }
+
+    atomic_dec( &p_iocb->pending );
+
+    wait_rv = wait_event_interruptible( p_info->wq, check_iocb_done(p_iocb) );
+
+    if ( wait_rv )
+        this_cpu_inc( p_info->stats->interrupted );
+
+    if ( wait_rv && !check_iocb_done(p_iocb) )
+        udma_abort( p_info );
+
+    rv = udma_iocb_finish( p_iocb );
+    if ( wait_rv && -ECANCELED == rv )
+        rv = wait_rv;
+
+    return rv;
+}
+
+ssize_t udma_read_iter(struct udma_file *p_file, struct kiocb *iocb, struct iov_iter *to)
+{
+    return udma_transfer_iter( p_file, UDMA_DIR_RX, iocb, to );
+}
+EXPORT_SYMBOL_GPL(udma_read_iter);
+
+ssize_t udma_write_iter(struct udma_file *p_file, struct kiocb *iocb, struct iov_iter *from)
+{
+    return udma_transfer_iter( p_file, UDMA_DIR_TX, iocb, from );
+}
+EXPORT_SYMBOL_GPL(udma_write_iter);
+
+// Whether read()/write() in dir go to a DMA channel rather than plain uio.
+bool udma_file_has_chan(struct udma_file *p_file, uint32_t dir)
+{
+    return p_file && udma_file_chan( p_file, dir, NULL );
+}
+EXPORT_SYMBOL_GPL(udma_file_has_chan);
+
+static long udma_ioctl_xfer( struct udma_file * p_file, void __user * argp )
+{
+    struct udma_xfer req;
+    struct udma_inflight_info * p_xfer;
+    struct udma_drvdata * p_info;
+    u64 start = local_clock();
+    long rv;
+
+    if ( copy_from_user( &req, argp, sizeof(req) ) )
+        return -EFAULT;
+
+    p_xfer = udma_xfer_from_req( p_file, &req );
+    if ( IS_ERR(p_xfer) )
+        return PTR_ERR(p_xfer);
+
+    p_info = p_xfer->p_info;
+    rv = udma_xfer_run( p_file, p_xfer );
+    udma_stat_call( p_info, start );
+
+    return rv;
+}
+
+/* Queue one UDMA_IOC_SUBMIT-style request; returns its cookie or -errno.
+ * With p_chan set, the transfer isn't issued yet and *p_chan says which
+ * channel it went to.
+ */
+static dma_cookie_t udma_submit_req( struct udma_file * p_file, const struct udma_xfer * req, struct dma_chan ** p_chan )
+{
+    struct udma_inflight_info * p_xfer;
+    dma_cookie_t cookie;
+
+    p_xfer = udma_xfer_from_req( p_file, req );
+    if ( IS_ERR(p_xfer) )
+        return PTR_ERR(p_xfer);
+
+    if ( p_chan )
+        *p_chan = p_xfer->p_info->chan;
+
+    p_xfer->owner = p_file;
+    p_xfer->user_data = req->user_data;
+    p_xfer->batched = req->flags & UDMA_XFER_MORE;
+
+    // Once submitted the transfer may complete and be reaped before we return.
+    cookie = udma_xfer_submit( p_xfer, req->flags & UDMA_XFER_NOWAIT, !p_chan );
+    if ( cookie < DMA_MIN_COOKIE )
+        udma_xfer_free( p_xfer );
+
+    return cookie;
+}
+
+static long udma_ioctl_submit( struct udma_file * p_file, void __user * argp )
+{
+    struct udma_xfer req;
+
+    if ( copy_from_user( &req, argp, sizeof(req) ) )
+        return -EFAULT;
+
+    return udma_submit_req( p_file, &req, NULL );
+}
+
+/* Like UDMA_IOC_SUBMIT for each entry, stopping at the first that fails,
+ * with a single dma_async_issue_pending() per run of entries on the same
+ * channel.  All but the last entry are batched for interrupt moderation.
+ */
+static long udma_ioctl_submit_batch( struct udma_file * p_file, void __user * argp )
+{
+    struct udma_batch batch;
+    struct udma_xfer * reqs;
+    __s32 * results;
+    struct dma_chan * pending = NULL;
+    unsigned int i;
+    long rv;
+
+    if ( copy_from_user( &batch, argp, sizeof(batch) ) )
+        return -EFAULT;
+
+    if ( !batch.count || batch.count > UDMA_BATCH_MAX )
+        return -EINVAL;
+
+    reqs = memdup_user( u64_to_user_ptr( batch.xfers ), batch.count * sizeof(*reqs) );
+    if ( IS_ERR(reqs) )
+        return PTR_ERR(reqs);
+
+    results = kcalloc( batch.count, sizeof(*results), GFP_KERNEL );
+    if ( !results )
+    {
+        kfree( reqs );
+        return -ENOMEM;
+    }
+
+    for ( i = 0; i < batch.count; ++i )
+    {
+        struct dma_chan * chan = NULL;
+        dma_cookie_t cookie;
+
+        if ( i + 1 < batch.count )
+            reqs[i].flags |= UDMA_XFER_MORE;
+
+        cookie = udma_submit_req( p_file, &reqs[i], &chan );
+        results[i] = cookie;
+        if ( cookie < DMA_MIN_COOKIE )
+            break;
+
+        if ( pending != chan )
+        {
+            if ( pending )
+                dma_async_issue_pending( pending );
+            pending = chan;
+        }
+    }
+
+    if ( pending )
+        dma_async_issue_pending( pending );
+
+    // Nothing submitted: fail the call.  Otherwise say how far it got.
+    rv = i ? i : results[0];
+    if ( copy_to_user( u64_to_user_ptr( batch.results ), results,
+                min( i + 1, batch.count ) * sizeof(*results) ) )
+        rv = -EFAULT;
+
+    kfree( results );
+    kfree( reqs );
+    return rv;
+}
+
+static int check_done( struct udma_file * p_file )
+{
+    int rv;
+    spin_lock_irq(&p_file->done_lock);
+
+    rv = !list_empty( &p_file->done_list );
+
+    spin_unlock_irq(&p_file->done_lock);
+
+    return rv;
+}
+
+static long udma_ioctl_reap( struct udma_file * p_file, void __user * argp )
+{
+    struct udma_reap reap;
+    struct udma_completion __user * ucomp;
+    struct udma_inflight_info * p_xfer;
+    long rv;
+    u32 n;
+
+    if ( copy_from_user( &reap, argp, sizeof(reap) ) )
+        return -EFAULT;
+
+    ucomp = u64_to_user_ptr( reap.completions );
+
+    if ( reap.timeout_ms < 0 )
+    {
+        if ( wait_event_interruptible( p_file->wq, check_done(p_file) ) )
+            return -ERESTARTSYS;
+    }
+    else if ( reap.timeout_ms > 0 )
+    {
+        rv = wait_event_interruptible_timeout( p_file->wq, check_done(p_file),
+                msecs_to_jiffies( reap.timeout_ms ) );
+        if ( rv < 0 )
+            return rv;
+    }
+
+    for ( n = 0; n < reap.max; ++n )
+    {
+        struct udma_completion comp;
+
+        spin_lock_irq( &p_file->done_lock );
+        p_xfer = list_first_entry_or_null( &p_file->done_list, struct udma_inflight_info, node );
+        if ( p_xfer )
+            list_del_init( &p_xfer->node );
+        spin_unlock_irq( &p_file->done_lock );
+
+        if ( !p_xfer )
+            break;
+
+        comp.user_data = p_xfer->user_data;
+        comp.result = p_xfer->status ? p_xfer->status : (s64)p_xfer->len;
+        comp.cookie = p_xfer->cookie;
+        comp.dir = p_xfer->p_info->dir;
+
+        if ( copy_to_user( &ucomp[n], &comp, sizeof(comp) ) )
+        {
+            // Keep it for the next attempt.
+            spin_lock_irq( &p_file->done_lock );
+            list_add( &p_xfer->node, &p_file->done_list );
+            spin_unlock_irq( &p_file->done_lock );
+            return n ? n : -EFAULT;
+        }
+
+        udma_xfer_free( p_xfer );
+    }
+
+    return n;
+}
+
+static long udma_ioctl_chan_info( struct udma_file * p_file, void __user * argp )
+{
+    struct udma_chan_info info;
+    struct udma_drvdata * p_info;
+
+    if ( copy_from_user( &info, argp, sizeof(info) ) )
+        return -EFAULT;
+
+    p_info = udma_find_chan( p_file->pdev_info, info.index );
+    if ( !p_info )
+        return -ENOENT;
+
+    info.dir = p_info->dir;
+    memset( info.name, 0, sizeof(info.name) );
+    strncpy( info.name, p_info->name, sizeof(info.name) - 1 );
+    info.busy_poll_hits = atomic64_read( &p_info->busy_poll_hits );
+    info.busy_poll_fallbacks = atomic64_read( &p_info->busy_poll_fallbacks );
+
+    return copy_to_user( argp, &info, sizeof(info) ) ? -EFAULT : 0;
+}
+
+static long udma_ioctl_set_chan( struct udma_file * p_file, void __user * argp )
+{
+    struct udma_chan_sel sel;
+    struct udma_drvdata * p_info = NULL;
+
+    if ( copy_from_user( &sel, argp, sizeof(sel) ) )
+        return -EFAULT;
+
+    if ( sel.dir != UDMA_DIR_RX && sel.dir != UDMA_DIR_TX )
+        return -EINVAL;
+
+    if ( UDMA_CHAN_NONE != sel.index )
+    {
+        p_info = udma_find_chan( p_file->pdev_info, sel.index );
+        if ( !p_info )
+            return -ENOENT;
+        if ( p_info->dir != sel.dir )
+            return -EINVAL;
+    }
+
+    if ( sel.dir == UDMA_DIR_RX )
+        WRITE_ONCE( p_file->rx_chan, p_info );
+    else
+        WRITE_ONCE( p_file->tx_chan, p_info );
+
+    return 0;
+}
+
+/* Runs once per period.  Publishes the period through the status page,
+ * counting an overrun when it refilled one userspace hadn't released yet.
+ */
+static void udma_cyclic_callback( void * data )
+{
+    struct udma_drvdata * p_info = (struct udma_drvdata *)data;
+    struct udma_pool_buf * p_buf = p_info->cyclic_buf;
+    struct udma_ring_status * ring = p_info->ring;
+    unsigned long flags;
+    u64 periods;
+
+    spin_lock_irqsave( &p_info->state_lock, flags );
+
+    if ( !p_buf->buf.coherent )
+        dma_sync_single_for_cpu( p_buf->buf.dma_dev,
+                p_buf->dma_addr + (dma_addr_t)ring->head * ring->period_len,
+                ring->period_len, p_buf->buf.dma_dir );
+
+    periods = ring->periods + 1;
+    if ( periods - READ_ONCE( ring->consumed ) > ring->num_periods )
+        ring->overruns++;
+    ring->head = periods % ring->num_periods;
+
+    // Data and head before the count userspace polls on.
+    smp_wmb();
+    WRITE_ONCE( ring->periods, periods );
+
+    spin_unlock_irqrestore( &p_info->state_lock, flags );
+
+    wake_up_interruptible( &p_info->wq );
+}
+
+static long udma_ioctl_cyclic_start( struct udma_file * p_file, void __user * argp )
+{
+    struct udma_pdev_drvdata * p_pdev_info = p_file->pdev_info;
+    struct udma_cyclic req;
+    struct udma_drvdata * p_info;
+    struct udma_pool_buf * p_buf;
+    struct udma_ring_status * ring;
+    struct dma_async_tx_descriptor * txn_desc;
+    unsigned int num_periods;
+    size_t ring_len;
+    dma_cookie_t cookie;
+    long rv = 0;
+
+    if ( copy_from_user( &req, argp, sizeof(req) ) )
+        return -EFAULT;
+
+    p_info = udma_find_chan( p_pdev_info, req.chan );
+    if ( !p_info )
+        return -ENOENT;
+    if ( p_info->dir != UDMA_DEV_TO_CPU )
+        return -EINVAL;
+    if ( !p_pdev_info->status || (req.chan + 1) * sizeof(*ring) > PAGE_SIZE )
+        return -ENOSPC;
+    if ( req.pool >= p_pdev_info->pool_count )
+        return -ENOENT;
+    p_buf = &p_pdev_info->pool[req.pool];
+
+    if ( !req.period_len || (req.period_len % UDMA_ALIGN_BYTES) )
+        return -EINVAL;
+    num_periods = req.num_periods ? req.num_periods : p_buf->buf.size / req.period_len;
+    ring_len = (size_t)req.period_len * num_periods;
+    if ( !num_periods || ring_len / num_periods != req.period_len || ring_len > p_buf->buf.size )
+        return -EINVAL;
+
+    mutex_lock( &p_file->lock );
+
+    if ( p_file->cyclic )
+    {
+        rv = -EBUSY;
+        goto out_unlock;
+    }
+
+    // Claim the channel, it has to be idle: the ring never completes.
+    spin_lock_irq( &p_info->state_lock );
+    if ( p_info->cyclic_owner || p_info->num_inflight )
+        rv = -EBUSY;
+    else
+        p_info->cyclic_owner = p_file;
+    spin_unlock_irq( &p_info->state_lock );
+    if ( rv )
+        goto out_unlock;
+
+    ring = &p_pdev_info->status[req.chan];
+    memset( ring, 0, sizeof(*ring) );
+    ring->num_periods = num_periods;
+    ring->period_len = req.period_len;
+    p_info->ring = ring;
+    p_info->cyclic_buf = p_buf;
+
+    if ( !p_buf->buf.coherent )
+        dma_sync_single_for_device( p_buf->buf.dma_dev, p_buf->dma_addr, ring_len, p_buf->buf.dma_dir );
+
+    txn_desc = dmaengine_prep_dma_cyclic(
+            p_info->chan,
+            p_buf->dma_addr,
+            ring_len,
+            req.period_len,
+            DMA_DEV_TO_MEM,
+            DMA_PREP_INTERRUPT);
+
+    if ( !txn_desc )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": %s: dmaengine_prep_dma_cyclic() failed\n", p_info->name);
+        rv = -ENOMEM;
+        goto err_release;
+    }
+
+    txn_desc->callback = udma_cyclic_callback;
+    txn_desc->callback_param = p_info;
+
+    cookie = dmaengine_submit( txn_desc );
+    if ( cookie < DMA_MIN_COOKIE )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": %s: dmaengine_submit() failed\n", p_info->name);
+        rv = cookie;
+        goto err_release;
+    }
+
+    dma_async_issue_pending( p_info->chan );
+    p_file->cyclic = p_info;
+
+    mutex_unlock( &p_file->lock );
+    return 0;
+
+    err_release:
+    spin_lock_irq( &p_info->state_lock );
+    p_info->cyclic_owner = NULL;
+    spin_unlock_irq( &p_info->state_lock );
+
+    out_unlock:
+    mutex_unlock( &p_file->lock );
+    return rv;
+}
+
+// Must be called with p_file->lock held.
+static void udma_cyclic_stop( struct udma_file * p_file )
+{
+    struct udma_drvdata * p_info = p_file->cyclic;
+
+    // Teardown already terminated it, and the channel may be released.
+    if ( !udma_chan_gone( p_info ) )
+    {
+        dmaengine_terminate_async( p_info->chan );
+        dmaengine_synchronize( p_info->chan );
+    }
+
+    spin_lock_irq( &p_info->state_lock );
+    p_info->cyclic_owner = NULL;
+    spin_unlock_irq( &p_info->state_lock );
+
+    WRITE_ONCE( p_file->cyclic, NULL );
+
+    // Let pollers and anyone waiting for a slot see the channel is free.
+    wake_up_interruptible( &p_info->wq );
+}
+
+static long udma_ioctl_cyclic_stop( struct udma_file * p_file )
+{
+    long rv = 0;
+
+    mutex_lock( &p_file->lock );
+    if ( p_file->cyclic )
+        udma_cyclic_stop( p_file );
+    else
+        rv = -EINVAL;
+    mutex_unlock( &p_file->lock );
+
+    return rv;
+}
+
+/* Called from uio_poll(), which adds in the uio interrupt events.
+ * Readable while submitted transfers wait to be reaped, or the file's
+ * cyclic ring holds periods userspace hasn't consumed; writable while the
+ * file's TX channel has a free slot.
+ */
+unsigned int udma_poll(struct udma_file *p_file, struct file *filp, poll_table *wait)
+{
+    struct udma_drvdata * p_info;
+    struct udma_ring_status * ring;
+    unsigned int mask = 0;
+
+    if ( !p_file )
+        return 0;
+
+    poll_wait( filp, &p_file->wq, wait );
+    if ( check_done( p_file ) )
+        mask |= POLLIN | POLLRDNORM;
+
+    p_info = READ_ONCE( p_file->tx_chan );
+    if ( p_info )
+    {
+        poll_wait( filp, &p_info->wq, wait );
+        if ( check_slot_free( p_info ) && !READ_ONCE( p_info->cyclic_owner ) )
+            mask |= POLLOUT | POLLWRNORM;
+    }
+
+    p_info = READ_ONCE( p_file->cyclic );
+    if ( p_info )
+    {
+        poll_wait( filp, &p_info->wq, wait );
+
+        ring = p_info->ring;
+        if ( READ_ONCE( ring->periods ) != READ_ONCE( ring->consumed ) )
+            mask |= POLLIN | POLLRDNORM;
+    }
+
+    return mask;
+}
+EXPORT_SYMBOL_GPL(udma_poll);
+
+static long udma_ioctl_set_busy_poll( struct udma_file * p_file, void __user * argp )
+{
+    __u32 usecs;
+
+    if ( get_user( usecs, (__u32 __user *)argp ) )
+        return -EFAULT;
+
+    if ( usecs > UDMA_BUSY_POLL_MAX_US )
+        return -EINVAL;
+
+    WRITE_ONCE( p_file->busy_poll_ns, (u64)usecs * NSEC_PER_USEC );
+    return 0;
+}
+
+/* dma-buf export.  Importers get the buffer's pages, mapped for their own
+ * device; CPU access through the dma-buf (mmap, kmap, vmap) is bracketed by
+ * begin/end_cpu_access, which sync udma's own mapping and every importer's.
+ */
+
+static int udma_dmabuf_attach( struct dma_buf * dmabuf, struct device * dev, struct dma_buf_attachment * attach )
+{
+    struct udma_dmabuf * d = dmabuf->priv;
+    struct udma_dmabuf_attach * a;
+    int rv;
+
+    a = kzalloc( sizeof(*a), GFP_KERNEL );
+    if ( !a )
+        return -ENOMEM;
+
+    // Every attachment maps its own copy of the table.
+    rv = sg_alloc_table_from_pages( &a->table, d->pages, d->num_pages, 0, d->buf->size, GFP_KERNEL );
+    if ( rv )
+    {
+        kfree( a );
+        return rv;
+    }
+
+    a->dev = dev;
+    a->dir = DMA_NONE;
+    attach->priv = a;
+
+    mutex_lock( &d->lock );
+    list_add_tail( &a->node, &d->attachments );
+    mutex_unlock( &d->lock );
+
+    return 0;
+}
+
+static void udma_dmabuf_detach( struct dma_buf * dmabuf, struct dma_buf_attachment * attach )
+{
+    struct udma_dmabuf * d = dmabuf->priv;
+    struct udma_dmabuf_attach * a = attach->priv;
+
+    mutex_lock( &d->lock );
+    list_del( &a->node );
+    mutex_unlock( &d->lock );
+
+    if ( a->dir != DMA_NONE )
+        dma_unmap_sg( a->dev, a->table.sgl, a->table.orig_nents, a->dir );
+    sg_free_table( &a->table );
+    kfree( a );
+}
+
+static struct sg_table * udma_dmabuf_map( struct dma_buf_attachment * attach, enum dma_data_direction dir )
+{
+    struct udma_dmabuf * d = attach->dmabuf->priv;
+    struct udma_dmabuf_attach * a = attach->priv;
+    struct sg_table * rv = &a->table;
+
+    mutex_lock( &d->lock );
+
+    if ( a->dir == DMA_NONE )
+    {
+        a->table.nents = dma_map_sg( a->dev, a->table.sgl, a->table.orig_nents, dir );
+        if ( a->table.nents )
+        {
+            a->dir = dir;
+            a->map_count = 1;
+        }
+        else
+            rv = ERR_PTR(-ENOMEM);
+    }
+    else if ( a->dir == dir )
+    {
+        a->map_count++;
+    }
+    else
+    {
+        rv = ERR_PTR(-EBUSY);   // mapped the other way until that is unmapped
+    }
+
+    mutex_unlock( &d->lock );
+    return rv;
+}
+
+static void udma_dmabuf_unmap( struct dma_buf_attachment * attach, struct sg_table * table,
+                               enum dma_data_direction dir )
+{
+    struct udma_dmabuf * d = attach->dmabuf->priv;
+    struct udma_dmabuf_attach * a = attach->priv;
+
+    mutex_lock( &d->lock );
+    if ( a->dir != DMA_NONE && !--a->map_count )
+    {
+        dma_unmap_sg( a->dev, a->table.sgl, a->table.orig_nents, a->dir );
+        a->dir = DMA_NONE;
+    }
+    mutex_unlock( &d->lock );
+}
+
+static void udma_dmabuf_release( struct dma_buf * dmabuf )
+{
+    struct udma_dmabuf * d = dmabuf->priv;
+
+    kvfree( d->pages );
+    kref_put( &d->pdev_info->ref, udma_pdev_release );
+    kfree( d );
+}
+
+/* dir is what the cpu does between begin and end_cpu_access.  Reading
+ * needs what devices wrote invalidated on the way in, writing needs it
+ * flushed for devices that read on the way out; either way importers
+ * mapped only the other way are left alone.
+ */
+static int udma_dmabuf_sync( struct udma_dmabuf * d, bool for_cpu, enum dma_data_direction dir )
+{
+    const enum dma_data_direction other = for_cpu ? DMA_TO_DEVICE : DMA_FROM_DEVICE;
+    struct udma_dmabuf_attach * a;
+
+    if ( dir == other )
+        return 0;   // writes only on the way in, or reads only on the way out
+
+    if ( !d->buf->coherent )
+        udma_buf_sync_range( d->buf, 0, d->buf->size, for_cpu, dir );
+
+    mutex_lock( &d->lock );
+    list_for_each_entry( a, &d->attachments, node )
+    {
+        if ( a->dir == DMA_NONE || a->dir == other )
+            continue;
+        if ( for_cpu )
+            dma_sync_sg_for_cpu( a->dev, a->table.sgl, a->table.orig_nents, a->dir );
+        else
+            dma_sync_sg_for_device( a->dev, a->table.sgl, a->table.orig_nents, a->dir );
+    }
+    mutex_unlock( &d->lock );
+
+    return 0;
+}
+
+static int udma_dmabuf_begin_cpu_access( struct dma_buf * dmabuf, enum dma_data_direction dir )
+{
+    return udma_dmabuf_sync( dmabuf->priv, true, dir );
+}
+
+static int udma_dmabuf_end_cpu_access( struct dma_buf * dmabuf, enum dma_data_direction dir )
+{
+    return udma_dmabuf_sync( dmabuf->priv, false, dir );
+}
+
+static void * udma_dmabuf_kmap( struct dma_buf * dmabuf, unsigned long pgnum )
+{
+    struct udma_dmabuf * d = dmabuf->priv;
+
+    if ( pgnum >= d->num_pages )
+        return NULL;
+
+    // Pool buffers through their own mapping, which is uncached if they are coherent.
+    if ( d->vaddr )
+        return d->vaddr + (pgnum << PAGE_SHIFT);
+    return page_address( d->pages[pgnum] );
+}
+
+static void udma_dmabuf_kunmap( struct dma_buf * dmabuf, unsigned long pgnum, void * vaddr )
+{
+}
+
+static void * udma_dmabuf_vmap( struct dma_buf * dmabuf )
+{
+    struct udma_dmabuf * d = dmabuf->priv;
+
+    if ( d->vaddr )
+        return d->vaddr;
+    return vmap( d->pages, d->num_pages, VM_MAP, PAGE_KERNEL );
+}
+
+static void udma_dmabuf_vunmap( struct dma_buf * dmabuf, void * vaddr )
+{
+    struct udma_dmabuf * d = dmabuf->priv;
+
+    if ( !d->vaddr )
+        vunmap( vaddr );
+}
+
+static int udma_dmabuf_mmap( struct dma_buf * dmabuf, struct vm_area_struct * vma )
+{
+    struct udma_dmabuf * d = dmabuf->priv;
+    struct udma_buf * buf = d->buf;
+    unsigned long addr = vma->vm_start;
+    unsigned long pg;
+    int rv;
+
+    if ( vma->vm_pgoff + vma_pages( vma ) > d->num_pages )
+        return -EINVAL;
+
+    if ( buf->coherent )
+    {
+        struct udma_pool_buf * p_buf = container_of( buf, struct udma_pool_buf, buf );
+
+        return dma_mmap_coherent( buf->dma_dev, vma, p_buf->vaddr, p_buf->dma_addr, buf->size );
+    }
+
+    for ( pg = vma->vm_pgoff; addr < vma->vm_end; ++pg, addr += PAGE_SIZE )
+    {
+        rv = remap_pfn_range( vma, addr, page_to_pfn( d->pages[pg] ), PAGE_SIZE, vma->vm_page_prot );
+        if ( rv )
+            return rv;
+    }
+
+    return 0;
+}
+
+static const struct dma_buf_ops udma_dmabuf_ops = {
+    .attach = udma_dmabuf_attach,
+    .detach = udma_dmabuf_detach,
+    .map_dma_buf = udma_dmabuf_map,
+    .unmap_dma_buf = udma_dmabuf_unmap,
+    .release = udma_dmabuf_release,
+    .begin_cpu_access = udma_dmabuf_begin_cpu_access,
+    .end_cpu_access = udma_dmabuf_end_cpu_access,
+    .kmap_atomic = udma_dmabuf_kmap,
+    .kunmap_atomic = udma_dmabuf_kunmap,
+    .kmap = udma_dmabuf_kmap,
+    .kunmap = udma_dmabuf_kunmap,
+    .mmap = udma_dmabuf_mmap,
+    .vmap = udma_dmabuf_vmap,
+    .vunmap = udma_dmabuf_vunmap,
+};
+
+// Every page of the buffer d exports, and its kernel mapping if it has a linear one.
+static int udma_dmabuf_pages( struct udma_dmabuf * d )
+{
+    struct udma_buf * buf = d->buf;
+    unsigned int i;
+
+    d->num_pages = buf->size >> PAGE_SHIFT;
+    d->pages = kmalloc_array( d->num_pages, sizeof(struct page*), GFP_KERNEL | __GFP_NOWARN );
+    if ( !d->pages )
+        d->pages = vmalloc( d->num_pages * sizeof(struct page*) );
+    if ( !d->pages )
+        return -ENOMEM;
+
+    if ( UDMA_BUF_HUGE == buf->type )
+    {
+        struct udma_huge_buf * p_buf = container_of( buf, struct udma_huge_buf, buf );
+
+        for ( i = 0; i < d->num_pages; ++i )
+            d->pages[i] = nth_page( p_buf->chunks[i >> UDMA_HUGE_ORDER], i & ((1 << UDMA_HUGE_ORDER) - 1) );
+        return 0;
+    }
+    else
+    {
+        struct udma_pool_buf * p_buf = container_of( buf, struct udma_pool_buf, buf );
+        struct scatterlist * sg;
+        struct sg_table sgt;
+        unsigned int n = 0;
+        int rv;
+
+        d->vaddr = p_buf->vaddr;
+
+        if ( !buf->coherent )
+        {
+            for ( i = 0; i < d->num_pages; ++i )
+                d->pages[i] = virt_to_page( p_buf->vaddr + (i << PAGE_SHIFT) );
+            return 0;
+        }
+
+        // Coherent memory may be remapped, only the DMA API knows its pages.
+        if ( (rv = dma_get_sgtable( buf->dma_dev, &sgt, p_buf->vaddr, p_buf->dma_addr, buf->size )) )
+            return rv;
+
+        for_each_sg( sgt.sgl, sg, sgt.orig_nents, i )
+        {
+            unsigned int pg;
+
+            for ( pg = 0; pg < sg->length >> PAGE_SHIFT && n < d->num_pages; ++pg )
+                d->pages[n++] = nth_page( sg_page( sg ), pg );
+        }
+        sg_free_table( &sgt );
+
+        return n == d->num_pages ? 0 : -EINVAL;
+    }
+}
+
+static long udma_ioctl_export( struct udma_file * p_file, void __user * argp )
+{
+    struct udma_export __user * p_req = argp;
+    DEFINE_DMA_BUF_EXPORT_INFO( exp_info );
+    struct udma_export req;
+    struct udma_dmabuf * d;
+    struct dma_buf * dmabuf;
+    int rv;
+
+    if ( copy_from_user( &req, argp, sizeof(req) ) )
+        return -EFAULT;
+
+    if ( req.flags != UDMA_XFER_POOL && req.flags != UDMA_XFER_HUGE )
+        return -EINVAL;
+
+    d = kzalloc( sizeof(*d), GFP_KERNEL );
+    if ( !d )
+        return -ENOMEM;
+
+    d->pdev_info = p_file->pdev_info;
+    mutex_init( &d->lock );
+    INIT_LIST_HEAD( &d->attachments );
+
+    d->buf = udma_file_get_buf( p_file, req.handle, req.flags );
+    if ( !d->buf )
+    {
+        rv = -ENOENT;
+        goto err_out;
+    }
+
+    if ( (rv = udma_dmabuf_pages( d )) )
+        goto err_out;
+
+    exp_info.ops = &udma_dmabuf_ops;
+    exp_info.size = d->buf->size;
+    exp_info.flags = O_RDWR;
+    exp_info.priv = d;
+
+    dmabuf = dma_buf_export( &exp_info );
+    if ( IS_ERR( dmabuf ) )
+    {
+        rv = PTR_ERR( dmabuf );
+        goto err_out;
+    }
+
+    // From here on udma_dmabuf_release() cleans up.
+    kref_get( &d->pdev_info->ref );
+
+    rv = dma_buf_fd( dmabuf, O_CLOEXEC );
+    if ( rv < 0 )
+    {
+        dma_buf_put( dmabuf );
+        return rv;
+    }
+
+    if ( put_user( rv, &p_req->fd ) )
+        return -EFAULT;     // the fd is installed by now, and stays
+
+    return rv;
+
+    err_out:
+    kvfree( d->pages );
+    kfree( d );
+    return rv;
+}
+
+struct udma_file * udma_open(struct uio_info *info)
+{
+    struct udma_pdev_drvdata * p_pdev_info;
+    struct udma_file * p_file;
+
+    // The file keeps the device's state, and its channels, around until it is released.
+    mutex_lock( &udma_pdev_lock );
+    p_pdev_info = udma_find_pdev( NULL, info );
+    if ( p_pdev_info )
+        kref_get( &p_pdev_info->ref );
+    mutex_unlock( &udma_pdev_lock );
+
+    if ( !p_pdev_info )
+        return NULL;
+
+    p_file = kzalloc( sizeof(*p_file), GFP_KERNEL );
+    if ( !p_file )
+    {
+        kref_put( &p_pdev_info->ref, udma_pdev_release );
+        return ERR_PTR(-ENOMEM);
+    }
+
+    p_file->pdev_info = p_pdev_info;
+    p_file->rx_chan = p_pdev_info->rx_default;
+    p_file->tx_chan = p_pdev_info->tx_default;
+    p_file->busy_poll_ns = (u64)busy_poll_us * NSEC_PER_USEC;
+    mutex_init( &p_file->lock );
+    idr_init( &p_file->bufs );
+    spin_lock_init( &p_file->done_lock );
+    INIT_LIST_HEAD( &p_file->done_list );
+    init_waitqueue_head( &p_file->wq );
+
+    return p_file;
+}
+EXPORT_SYMBOL_GPL(udma_open);
+
+static int udma_release_buf( int id, void * p, void * data )
+{
+    struct udma_buf * buf = p;
+
+    kref_put( &buf->ref, udma_buf_release );
+    return 0;
+}
+
+static int check_file_idle( struct udma_file * p_file )
+{
+    int rv;
+    spin_lock_irq(&p_file->done_lock);
+
+    rv = (0 == p_file->num_inflight);
+
+    spin_unlock_irq(&p_file->done_lock);
+
+    return rv;
+}
+
+static int check_chan_used_by( struct udma_drvdata * p_info, struct udma_file * p_file )
+{
+    struct udma_inflight_info * p_xfer;
+    int rv = 0;
+
+    spin_lock_irq(&p_info->state_lock);
+
+    list_for_each_entry( p_xfer, &p_info->inflight_list, node )
+    {
+        if ( p_xfer->owner == p_file )
+        {
+            rv = 1;
+            break;
+        }
+    }
+
+    spin_unlock_irq(&p_info->state_lock);
+
+    return rv;
+}
+
+void udma_release(struct udma_file *p_file)
+{
+    struct udma_inflight_info * p_xfer, * tmp;
+    struct udma_pdev_drvdata * p_pdev_info;
+    struct udma_drvdata * p_info;
+
+    if ( !p_file )
+        return;
+
+    p_pdev_info = p_file->pdev_info;
+
+    mutex_lock( &p_file->lock );
+    if ( p_file->cyclic )
+        udma_cyclic_stop( p_file );
+    mutex_unlock( &p_file->lock );
+
+    // Give submitted transfers a chance to finish before pulling the plug.
+    if ( !wait_event_timeout( p_file->wq, check_file_idle(p_file), UDMA_RELEASE_TIMEOUT ) )
+    {
+        printk( KERN_WARNING KBUILD_MODNAME ": aborting transfers left in flight at close\n");
+
+        list_for_each_entry( p_info, &p_pdev_info->udma_list, node )
+        {
+            if ( !udma_chan_gone( p_info ) && check_chan_used_by( p_info, p_file ) )
+                udma_abort( p_info );
+        }
+    }
+
+    list_for_each_entry_safe( p_xfer, tmp, &p_file->done_list, node )
+    {
+        list_del( &p_xfer->node );
+        udma_xfer_free( p_xfer );
+    }
+
+    idr_for_each( &p_file->bufs, udma_release_buf, NULL );
+    idr_destroy( &p_file->bufs );
+    kfree( p_file );
+
+    kref_put( &p_pdev_info->ref, udma_pdev_release );
+}
+EXPORT_SYMBOL_GPL(udma_release);
+
+long udma_ioctl(struct udma_file *p_file, unsigned int cmd, unsigned long arg)
+{
+    void __user * argp = (void __user *)arg;
+
+    switch ( cmd )
+    {
+    case UDMA_IOC_REGISTER:
+        return udma_ioctl_register( p_file, argp );
+    case UDMA_IOC_UNREGISTER:
+        return udma_ioctl_unregister( p_file, argp );
+    case UDMA_IOC_IMPORT:
+        return udma_ioctl_import( p_file, argp );
+    case UDMA_IOC_SYNC:
+        return udma_ioctl_sync( p_file, argp );
+    case UDMA_IOC_XFER:
+        return udma_ioctl_xfer( p_file, argp );
+    case UDMA_IOC_SUBMIT:
+        return udma_ioctl_submit( p_file, argp );
+    case UDMA_IOC_SUBMIT_BATCH:
+        return udma_ioctl_submit_batch( p_file, argp );
+    case UDMA_IOC_REAP:
+        return udma_ioctl_reap( p_file, argp );
+    case UDMA_IOC_CHAN_INFO:
+        return udma_ioctl_chan_info( p_file, argp );
+    case UDMA_IOC_SET_CHAN:
+        return udma_ioctl_set_chan( p_file, argp );
+    case UDMA_IOC_SET_BUSY_POLL:
+        return udma_ioctl_set_busy_poll( p_file, argp );
+    case UDMA_IOC_CYCLIC_START:
+        return udma_ioctl_cyclic_start( p_file, argp );
+    case UDMA_IOC_CYCLIC_STOP:
+        return udma_ioctl_cyclic_stop( p_file );
+    case UDMA_IOC_EXPORT:
+        return udma_ioctl_export( p_file, argp );
+    default:
+        return -ENOTTY;
+    }
+}
+EXPORT_SYMBOL_GPL(udma_ioctl);
+
+
+void teardown_udma( struct platform_device *pdev)
+{
+    struct udma_pdev_drvdata * p_pdev_info;
+    struct udma_drvdata * p_info;
+
+    mutex_lock( &udma_pdev_lock );
+    p_pdev_info = udma_find_pdev( pdev, NULL );
+    if ( p_pdev_info )
+        list_del( &p_pdev_info->node );
+    mutex_unlock( &udma_pdev_lock );
+
+    if ( !p_pdev_info )
+        return;
+
+    udma_stats_teardown( p_pdev_info );
+    udma_mcache_teardown( p_pdev_info );
+
+    list_for_each_entry( p_info, &p_pdev_info->udma_list, node )
+    {
+        if ( !udma_chan_gone( p_info ) )
+            udma_chan_teardown( p_info );
+    }
 
+    // The buffers go once no exported dma-buf is left using them either.
+    udma_maps_clear( p_pdev_info );
+    kref_put( &p_pdev_info->ref, udma_pdev_release );
 }
 EXPORT_SYMBOL_GPL(teardown_udma);
@@ -39,6 +39,19 @@
 #include <linux/fs.h>
 #include <linux/cdev.h>
 #include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/uio_driver.h>
+#include <linux/uio.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/percpu.h>
+#include <linux/kobject.h>
+#include <linux/dma-buf.h>
+#include <linux/mmu_notifier.h>
+
+#include <linux/udma_ioctl.h>
 
 #define UDMA_DEV_NAME_MAX_CHARS (16)
 
@@ -52,65 +65,351 @@ enum udma_dir {
     UDMA_CPU_TO_DEV = 2,   // TX
 };
 
-/* Right now the I/O concept is very simple -- all reads and writes
- * are blocking, and concurrent reads and writes are not allowed.
- * Concurrent open is also disallowed.
+/* State of a single transfer.  read()/write() and UDMA_IOC_XFER block until
+ * their transfer completes; UDMA_IOC_SUBMIT queues it and returns, and the
+ * completion is picked up later through UDMA_IOC_REAP.  Up to max_inflight
+ * transfers per channel can be queued on the dmaengine at a time.
  */
 enum dma_fsm_state {
     DMA_IDLE = 0,
-    DMA_IN_FLIGHT = 1,
+    DMA_IN_FLIGHT = 1,      // on its channel's inflight_list
+    DMA_ABORTING = 2,       // taken off it by udma_abort(), about to fail with -ECANCELED
     DMA_COMPLETING = 3,
 };
 
-// These fields should only be valid during an ongoing read/write call.
+enum udma_buf_type {
+    UDMA_BUF_USER = 0,      // user pages, registered through UDMA_IOC_REGISTER
+    UDMA_BUF_POOL = 1,      // kernel memory from the per-device pool
+    UDMA_BUF_HUGE = 2,      // per-device buffer built from PMD-sized chunks
+    UDMA_BUF_DMABUF = 3,    // another driver's dma-buf, imported through UDMA_IOC_IMPORT
+};
+
+// Huge buffers are allocated and DMA-mapped in chunks of this size; userspace maps them with small pages.
+#define UDMA_HUGE_ORDER     (PMD_SHIFT - PAGE_SHIFT)
+#define UDMA_HUGE_SIZE      (PMD_SIZE)
+
+// uio map memtype of a huge buffer; uio_mmap() hands these to udma_mmap().
+#define UIO_MEM_UDMA        (0x10)
+
+/* A buffer that is DMA-mapped once and then addressed by (handle, offset,
+ * length).  User buffers stay mapped until they are unregistered or the
+ * file is closed, and transfers only take a reference on them.  Pool
+ * buffers belong to the device and live until it is torn down.
+ */
+struct udma_buf {
+    struct kref     ref;
+    enum udma_buf_type type;
+    u32             handle;
+    uint32_t        dir;        // UDMA_DIR_* mask it was registered for
+    enum dma_data_direction dma_dir;
+    size_t          size;
+    struct device * dma_dev;
+    bool            coherent;   // no cache maintenance needed around transfers
+
+    struct page **  pinned_pages;
+    unsigned int    num_pages;
+    unsigned int    page_offset;    // of the start in the first page
+    unsigned long * dirty;      // RX user buffers: pages a transfer wrote to
+    struct sg_table table;
+    int             nents;      // as returned by dma_map_sg()
+
+    struct dma_buf * dmabuf;    // UDMA_BUF_DMABUF: the imported buffer,
+    struct dma_buf_attachment * attach;     // attached to dma_dev
+    struct sg_table * sgt;      // and mapped by its exporter; table is a copy of it
+};
+
+// A kernel-allocated DMA buffer, exported to userspace as an extra uio map.
+struct udma_pool_buf {
+    struct udma_buf buf;        // single-entry table covering the whole buffer
+    void *          vaddr;
+    dma_addr_t      dma_addr;
+    struct uio_mem *mem;        // the uio map userspace mmap()s it through
+};
+
+// A buffer of PMD-sized chunks, exported as a uio map.
+struct udma_huge_buf {
+    struct udma_buf buf;        // one table entry per chunk
+    struct page **  chunks;
+    unsigned int    num_chunks;
+    struct uio_mem *mem;
+};
+
+/* A pool or huge buffer exported as a dma-buf by UDMA_IOC_EXPORT.  It
+ * holds a reference on the device's udma_pdev_drvdata, so the buffer stays
+ * around for importers after the device itself is gone.
+ */
+struct udma_dmabuf {
+    struct udma_pdev_drvdata * pdev_info;
+    struct udma_buf * buf;
+    void *          vaddr;      // kernel mapping of a pool buffer, NULL for huge
+    struct page **  pages;      // every page of the buffer, for kmap() and vmap()
+    unsigned int    num_pages;
+    struct sg_table table;      // the same, as a table each attachment gets a copy of
+
+    struct mutex    lock;       // protects attachments
+    struct list_head attachments;
+};
+
+// An importing device's view of a udma_dmabuf.
+struct udma_dmabuf_attach {
+    struct list_head node;
+    struct device * dev;
+    struct sg_table table;
+    enum dma_data_direction dir;    // DMA_NONE while not mapped
+    unsigned int    map_count;      // map_dma_buf calls not yet unmapped
+};
+
+/* Per-channel statistics, kept per cpu so that they can be updated
+ * without a lock from wherever the event happens; they are only summed
+ * when read.  Histogram bucket b counts values in [2^(b-1), 2^b), the last
+ * one everything above.
+ */
+enum udma_hist {
+    UDMA_HIST_SIZE,     // bytes per completed transfer
+    UDMA_HIST_PREP,     // ns pinning and mapping, or slicing a buffer
+    UDMA_HIST_DMA,      // ns from submit to completion
+    UDMA_HIST_CALL,     // ns in a blocking read(), write() or UDMA_IOC_XFER
+    UDMA_NUM_HISTS
+};
+
+#define UDMA_HIST_BUCKETS   (40)
+
+struct udma_stats {
+    u64     transfers;      // completed successfully
+    u64     bytes;          // ... and what they moved
+    u64     errors;         // completed with an error other than being aborted
+    u64     terminations;   // times the channel was aborted
+    u64     interrupted;    // waits for a transfer or a slot cut short by a signal
+    u64     hist[UDMA_NUM_HISTS][UDMA_HIST_BUCKETS];
+};
+
+// Per-open-file udma state, created by udma_open() when the uio device is opened.
+struct udma_file {
+    struct udma_pdev_drvdata *pdev_info;
+    struct udma_drvdata * rx_chan;      // read(), or NULL for plain uio interrupt reads
+    struct udma_drvdata * tx_chan;      // write(), or NULL for plain uio irq control
+
+    struct mutex    lock;       // protects bufs and cyclic
+    struct idr      bufs;       // handle -> struct udma_buf
+    struct udma_drvdata * cyclic;   // channel this file runs in cyclic mode, or NULL
+    u64             busy_poll_ns;   // how long blocking transfers spin before sleeping, 0: don't
+
+    spinlock_t      done_lock;  // protects below, nests inside udma_drvdata.state_lock
+    struct list_head done_list; // completed submitted transfers, waiting to be reaped
+    unsigned int    num_inflight;
+    wait_queue_head_t wq;       // woken when a submitted transfer completes
+};
+
+// How long closing a file waits for its submitted transfers before aborting them.
+#define UDMA_RELEASE_TIMEOUT    (HZ)
+
+/* The transfers making up one read_iter()/write_iter() call, one per
+ * iovec segment.  Synchronous callers wait for pending to drop to zero;
+ * for an async kiocb (aio, io_uring) the last completion schedules work
+ * that releases the transfers and completes the iocb.
+ */
+struct udma_iocb {
+    struct kiocb *  iocb;       // NULL when the caller waits itself
+    struct udma_drvdata * p_info;
+    struct list_head xfers;     // udma_inflight_info.iocb_node, in submission order
+    atomic_t        pending;    // submitted and not yet completed, +1 while still submitting
+    struct work_struct work;
+};
+
+/* One transfer, from preparation until it is freed.  Blocking callers own
+ * it on their stack frame's behalf; submitted ones belong to a udma_file
+ * and sit on its done_list between completion and reaping, and iter ones
+ * belong to a udma_iocb.
+ */
 struct udma_inflight_info {
+    struct list_head node;      // on udma_drvdata.inflight_list, then udma_file.done_list
+    struct udma_drvdata * p_info;
+    struct udma_file * owner;   // NULL for blocking transfers
+    struct udma_iocb * iocb;    // NULL unless part of a read_iter()/write_iter()
+    struct list_head iocb_node;
+
+    enum dma_fsm_state state;   // protected by p_info->state_lock
+    dma_cookie_t    cookie;
+    __u64           user_data;
+    size_t          len;        // requested, then what was actually transferred
+    int             status;     // 0 or -errno once completed
+
     struct page **  pinned_pages;
     struct sg_table table;
     unsigned int    num_pages;
+    unsigned int    page_offset;    // of userbuf in the first pinned page
+    size_t          buf_offset;     // of the slice in buf
+    int             nents;      // mapped entries of table to hand to the dmaengine
+    struct udma_buf * buf;      // registered buffer the table is a slice of, or NULL
     bool            table_allocated;
     bool            pages_pinned;
     bool            dma_mapped;
     bool            dma_started;
+    u64             submit_ns;  // local_clock() when handed to the engine
+    bool            batched;    // the caller has more to submit right behind it
+    bool            irq;        // its descriptor interrupts and runs our callback
+    bool            nosync;     // UDMA_XFER_NOSYNC: leave the buffer's cache maintenance to userspace
+    bool            iov;        // pinned_pages are several iovecs' back to back
+
+    /* Preallocated context from the channel's xfer_pool: a page array and
+     * a table for transfers of up to pool_pages pages, reused as they are.
+     */
+    bool            pooled;
+    unsigned int    pool_pages;
+    struct page **  pool_page_array;
+    struct sg_table pool_table;
+};
+
+/* TX channels named in "udma,stripe-group", feeding one stream aggregator.
+ * A write() of more than a stripe on any of them is dealt out to all of
+ * them round-robin, a stripe at a time, so that the engines run in
+ * parallel.
+ */
+#define UDMA_GROUP_MAX_CHANS (8)
+
+struct udma_chan_group {
+    struct udma_drvdata * chans[UDMA_GROUP_MAX_CHANS];  // in property order
+    unsigned int    num_chans;
+    size_t          stripe_size;
+};
+
+/* A channel's directory in sysfs.  An open stats file can keep it around
+ * after the channel is gone, so it owns the channel's counters and frees
+ * them with its last reference.
+ */
+struct udma_chan_kobj {
+    struct kobject  kobj;
+    struct udma_stats __percpu * stats;
 };
 
 struct udma_drvdata {
     struct platform_device *pdev;
+    struct udma_pdev_drvdata * pdev_info;
 
     char name[UDMA_DEV_NAME_MAX_CHARS];
     uint32_t dir;   // udma_dir
+    unsigned int index;     // position in "dma-names"
+    unsigned int max_seg_size;  // longest sg entry the engine takes
+    struct udma_chan_group * group;     // the stripe group it is in, or NULL
 
     struct semaphore sem;   /* protects mutable data below */
 
     bool        in_use;
     atomic_t    accepting;
 
-    spinlock_t state_lock;  // protects state below, may be taken from interrupt (tasklet) context
-    enum dma_fsm_state state;
-    struct udma_inflight_info inflight;
+    spinlock_t state_lock;  // protects the inflight state below, may be taken from interrupt (tasklet) context
+    struct list_head inflight_list;     // udma_inflight_info in submission order
+    unsigned int    num_inflight;
+    unsigned int    max_inflight;
+
+    wait_queue_head_t    wq;    // woken when a transfer completes or a slot frees up
 
-    wait_queue_head_t    wq;
+    /* Interrupt moderation for batched transfers */
+    unsigned int    irq_every;      // a batched descriptor asks for an interrupt this often
+    unsigned int    since_irq;      // batched descriptors since the last one that did, under state_lock
+    ktime_t         irq_timeout;
+    struct hrtimer  irq_timer;      // completes batches that ended without an interrupt
+
+    /* Preallocated transfer contexts, so that the hot path doesn't allocate */
+    spinlock_t      xfer_pool_lock;
+    struct list_head xfer_pool;     // free udma_inflight_info, on their node
+    bool            xfer_pool_closed;   // torn down: pooled transfers freed later just go
 
     /* dmaengine */
     struct dma_chan *chan;
 
+    /* Cyclic mode, between UDMA_IOC_CYCLIC_START and _STOP */
+    struct udma_file *  cyclic_owner;   // protected by state_lock, NULL when not running
+    struct udma_pool_buf * cyclic_buf;
+    struct udma_ring_status * ring;     // this channel's slot in the status page
+
     /* device accounting */
     dev_t           udma_devt;
     struct cdev     udma_cdev;
     struct device * udma_dev;
 
     /* Statistics */
-    atomic_t    packets_sent;
-    atomic_t    packets_rcvd;
+    struct udma_stats __percpu * stats;
+    struct udma_chan_kobj * kobj;   // <platform device>/udma/<name>/ in sysfs, or NULL
+    atomic64_t  busy_poll_hits;         // blocking transfers that completed while spinning
+    atomic64_t  busy_poll_fallbacks;    // ... and ones that ran out of budget and slept
 
     struct list_head node;
     bool init_done;
 };
 
-/* LOCK ORDERING:  if taking both sem and state_lock, must always take sem first */
+/* LOCK ORDERING:  if taking both sem and state_lock, must always take sem first;
+ * udma_file.done_lock nests inside state_lock */
+
+/* Mapping cache: user buffers that read(), write() and UDMA_IOC_XFER were
+ * given recently, left pinned and mapped so that reusing them is as cheap
+ * as a registered buffer.  There is one cache per process (mm) and device,
+ * entries are least recently used last.  An mmu notifier drops the ones
+ * whose memory gets unmapped, remapped or copied on write.
+ */
+struct udma_mcache_entry {
+    struct list_head node;          // on udma_mcache.lru or .dead
+    unsigned long   addr;           // user range the buffer covers
+    size_t          len;
+    uint32_t        dir;
+    struct udma_buf * buf;          // the cache's reference
+};
+
+struct udma_mcache {
+    struct list_head node;          // on udma_pdev_drvdata.mcaches
+    struct udma_pdev_drvdata * pdev_info;
+    struct mm_struct * mm;
+    struct mmu_notifier mn;
+
+    spinlock_t      lock;           // protects below, taken from the notifier
+    struct list_head lru;
+    unsigned int    entries;
+    size_t          pinned;         // bytes, over all entries
+    unsigned long   seq;            // bumped by every invalidation
+    bool            released;       // the mm is gone, the cache waits to be reaped
+
+    /* Dropped entries.  Unpinning may need page locks the notifier's caller
+     * holds, so the entries are released from a work item.
+     */
+    struct list_head dead;
+    struct work_struct work;
+};
 
 struct udma_pdev_drvdata {
+    struct kref     ref;            // the device's, and one per exported dma-buf
+    struct platform_device *pdev;
+    struct uio_info *uioinfo;
+    struct list_head node;          // on udma_pdev_list
+
     struct list_head udma_list;    // list of udma_drvdata instances created in
                                     // relation to this platform device
+    unsigned int    num_chans;
+    unsigned int    max_seg_size;   // smallest of the channels'
+    struct udma_drvdata * rx_default;   // first channel each way, what files start out using
+    struct udma_drvdata * tx_default;
+    struct udma_chan_group tx_group;
+
+    /* Buffer pool, sized by the pool_* module parameters or the
+     * "udma,pool-*" device-tree properties.
+     */
+    struct udma_pool_buf *pool;
+    unsigned int    pool_count;
+    size_t          pool_size;
+    bool            pool_coherent;
+
+    struct udma_huge_buf *huge;
+    unsigned int    huge_count;
+    size_t          huge_size;
+
+    bool            reserved_mem;   // "memory-region" set up for the coherent pool
+
+    struct udma_ring_status *status;    // one per channel, exported as "udma_status"
+
+    struct mutex    mcache_lock;    // protects the list
+    struct list_head mcaches;       // udma_mcache per process that transferred
+
+    struct kobject * sysfs_dir;     // "udma", holding a directory per channel
+    struct dentry * debugfs_dir;    // "udma-<device>", holding a file per channel
 };
 
 
@@ -124,10 +423,18 @@ static int devno_in_use[NUM_DEVICE_NUMBERS_TO_ALLOCATE];
 static struct class *udma_class;
 static DEFINE_SEMAPHORE(devno_lock);
 
-extern bool is_udma(void); 
-extern int check_udma(struct platform_device *pdev);
-extern ssize_t udma_read(struct file *filp, char __user *userbuf, size_t count, loff_t *f_pos);
-extern ssize_t udma_write(struct file *filp, const char __user *userbuf, size_t count, loff_t *f_pos);
+extern int check_udma(struct platform_device *pdev, struct uio_info *uioinfo);
+extern bool udma_file_has_chan(struct udma_file *p_file, uint32_t dir);
+extern ssize_t udma_read(struct udma_file *p_file, char __user *userbuf, size_t count);
+extern ssize_t udma_write(struct udma_file *p_file, const char __user *userbuf, size_t count);
+extern ssize_t udma_read_iter(struct udma_file *p_file, struct kiocb *iocb, struct iov_iter *to);
+extern ssize_t udma_write_iter(struct udma_file *p_file, struct kiocb *iocb, struct iov_iter *from);
 extern void teardown_udma( struct platform_device *pdev);
+extern struct udma_file * udma_open(struct uio_info *info);
+extern void udma_release(struct udma_file *p_file);
+extern long udma_ioctl(struct udma_file *p_file, unsigned int cmd, unsigned long arg);
+extern unsigned int udma_poll(struct udma_file *p_file, struct file *filp, poll_table *wait);
+extern int udma_mem_dma_addr(struct uio_mem *mem, dma_addr_t *dma_addr);
+extern int udma_mmap(struct uio_mem *mem, struct vm_area_struct *vma);
 
 
@@ -0,0 +1,235 @@
+/*
+ * udma ioctl interface -- shared between the udma driver and userspace.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _UDMA_IOCTL_H_
+#define _UDMA_IOCTL_H_
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+// Transfer directions, same values as enum udma_dir in udma.h.
+#define UDMA_DIR_RX     (1)     // device to cpu
+#define UDMA_DIR_TX     (2)     // cpu to device
+#define UDMA_DIR_BOTH   (UDMA_DIR_RX | UDMA_DIR_TX)
+
+/* UDMA_IOC_REGISTER: pin and DMA-map a user buffer once, so that later
+ * transfers can use it without paying for get_user_pages_fast() and
+ * dma_map_sg() on every call.
+ */
+struct udma_region {
+    __u64   addr;       // in: user virtual address of the buffer
+    __u64   len;        // in: length of the buffer in bytes
+    __u32   dir;        // in: UDMA_DIR_* the buffer will be used for
+    __u32   handle;     // out: non-zero handle naming the buffer
+};
+
+/* UDMA_IOC_XFER: blocking transfer to/from [offset, offset+len) of a
+ * registered buffer, or of a buffer from the driver's pool (mmap()ed
+ * through the uio map named "udma_pool<index>").  With handle 0 and no
+ * UDMA_XFER_POOL, addr is a plain user pointer, as for read()/write().
+ * Returns the number of bytes transferred.
+ *
+ * UDMA_IOC_SUBMIT: same request, but only queues the transfer and returns
+ * its (positive) dmaengine cookie.  The result is collected later with
+ * UDMA_IOC_REAP; poll() on the file reports POLLIN while there are any to
+ * reap, and POLLOUT while the file's TX channel can take another.
+ *
+ * Submitting a batch with UDMA_XFER_MORE on all but the last transfer
+ * saves the completion interrupts of the rest; they are completed along
+ * with a later one, or by a timer if the batch stalls.  An RX transfer
+ * completed that way reports its full length, so leave UDMA_XFER_MORE off
+ * where short packets matter.
+ *
+ * UDMA_XFER_NOSYNC skips the cache maintenance udma otherwise does on the
+ * slice of a cached (streaming pool, huge or registered) buffer before and
+ * after the transfer; do it with UDMA_IOC_SYNC on just the bytes the CPU
+ * touches instead.  Plain user pointers can't skip it.
+ */
+#define UDMA_XFER_POOL      (1 << 0)    // handle is a pool buffer index
+#define UDMA_XFER_NOWAIT    (1 << 1)    // SUBMIT: fail with EAGAIN rather than wait for a free slot
+#define UDMA_XFER_CHAN      (1 << 2)    // use channel chan instead of the file's default for dir
+#define UDMA_XFER_HUGE      (1 << 3)    // handle is a huge buffer index ("udma_huge<index>")
+#define UDMA_XFER_MORE      (1 << 4)    // SUBMIT: more follow, this one needn't raise an interrupt
+#define UDMA_XFER_NOSYNC    (1 << 5)    // buffers only: no implicit cache maintenance, see UDMA_IOC_SYNC
+
+struct udma_xfer {
+    __u64   addr;       // user pointer, if handle is 0 and UDMA_XFER_POOL is clear
+    __u64   offset;
+    __u64   len;
+    __u64   user_data;  // SUBMIT: handed back in struct udma_completion
+    __u32   handle;     // as returned by UDMA_IOC_REGISTER, or a pool index
+    __u32   dir;        // UDMA_DIR_RX or UDMA_DIR_TX
+    __u32   flags;      // UDMA_XFER_*
+    __u32   chan;       // channel index, with UDMA_XFER_CHAN
+};
+
+/* UDMA_IOC_SUBMIT_BATCH: UDMA_IOC_SUBMIT for count entries of xfers in one
+ * call, issued to the engine together and batched (UDMA_XFER_MORE) but
+ * for the last.  Stops at the first entry that fails.  Returns how many
+ * were submitted, or -errno if the first one failed; results[i] gets entry
+ * i's cookie, and the failed entry's -errno.
+ */
+#define UDMA_BATCH_MAX      (256)
+
+struct udma_batch {
+    __u64   xfers;      // user pointer to an array of struct udma_xfer
+    __u64   results;    // user pointer to an array of __s32
+    __u32   count;      // entries in each, at most UDMA_BATCH_MAX
+    __u32   reserved;
+};
+
+/* UDMA_IOC_IMPORT: attach and map a dma-buf (udmabuf, a DRM dumb buffer,
+ * another driver's export) for the device, so that transfers go straight
+ * to or from it.  The handle it returns works like one from
+ * UDMA_IOC_REGISTER and is released by UDMA_IOC_UNREGISTER; the fd itself
+ * can be closed once imported.  CPU access to the memory is synchronized
+ * by its exporter (DMA_BUF_IOCTL_SYNC), not by udma.
+ */
+struct udma_import {
+    __s32   fd;         // in: dma-buf fd
+    __u32   dir;        // in: UDMA_DIR_* it will be used for
+    __u32   handle;     // out
+    __u32   reserved;
+    __u64   len;        // out: size of the buffer
+};
+
+/* UDMA_IOC_SYNC: cache maintenance on [offset, offset+len) of a registered,
+ * pool or huge buffer, like DMA_BUF_IOCTL_SYNC: UDMA_SYNC_START before the
+ * CPU reads (UDMA_SYNC_READ) or writes (UDMA_SYNC_WRITE) the range, and
+ * UDMA_SYNC_END after, before the device gets it again.  Coherent buffers
+ * need none and return at once; imported dma-bufs are synced whole by
+ * their exporter.
+ */
+#define UDMA_SYNC_READ      (1 << 0)
+#define UDMA_SYNC_WRITE     (2 << 0)
+#define UDMA_SYNC_RW        (UDMA_SYNC_READ | UDMA_SYNC_WRITE)
+#define UDMA_SYNC_START     (0 << 2)
+#define UDMA_SYNC_END       (1 << 2)
+
+struct udma_sync {
+    __u64   offset;
+    __u64   len;
+    __u32   handle;     // as for struct udma_xfer
+    __u32   flags;      // UDMA_XFER_POOL or UDMA_XFER_HUGE, as for struct udma_xfer
+    __u32   sync;       // UDMA_SYNC_START or _END, | UDMA_SYNC_READ and/or _WRITE
+    __u32   reserved;
+};
+
+/* UDMA_IOC_REAP: collect completed submitted transfers, in completion
+ * order.  Returns the number of entries written to completions.
+ */
+struct udma_completion {
+    __u64   user_data;
+    __s64   result;     // bytes transferred, or -errno
+    __s32   cookie;     // as returned by UDMA_IOC_SUBMIT
+    __u32   dir;
+};
+
+struct udma_reap {
+    __u64   completions;    // user pointer to an array of struct udma_completion
+    __u32   max;            // number of entries in that array
+    __s32   timeout_ms;     // <0: wait for one, 0: don't wait, >0: wait at most this long
+};
+
+/* Channels are numbered in the order of the device's "dma-names"
+ * property.  UDMA_IOC_CHAN_INFO describes channel index, and fails with
+ * ENOENT past the last one.
+ */
+struct udma_chan_info {
+    __u32   index;      // in
+    __u32   dir;        // out: UDMA_DIR_RX or UDMA_DIR_TX
+    char    name[16];   // out: its "dma-names" entry
+    __u64   busy_poll_hits;         // out: see UDMA_IOC_SET_BUSY_POLL
+    __u64   busy_poll_fallbacks;    // out
+};
+
+/* UDMA_IOC_SET_CHAN: choose the channel this file's read()/write() (and
+ * transfers without UDMA_XFER_CHAN) use for dir.  Files start out on the
+ * first channel in each direction.  UDMA_CHAN_NONE gives read() or write()
+ * back to plain uio: interrupt counts and irq control.
+ */
+#define UDMA_CHAN_NONE  (-1)
+
+struct udma_chan_sel {
+    __s32   index;      // channel index, or UDMA_CHAN_NONE
+    __u32   dir;        // UDMA_DIR_RX or UDMA_DIR_TX, must match the channel
+};
+
+/* UDMA_IOC_CYCLIC_START: loop an RX channel over the first num_periods *
+ * period_len bytes of a pool buffer until UDMA_IOC_CYCLIC_STOP (or close).
+ * The channel takes no other transfers while it runs.  Progress is
+ * published in the uio map named "udma_status": one struct
+ * udma_ring_status per channel, indexed by channel number.  poll() on the
+ * file reports POLLIN while periods != consumed.
+ */
+struct udma_cyclic {
+    __u32   chan;           // RX channel index
+    __u32   pool;           // pool buffer index, used as the ring
+    __u32   period_len;     // bytes per period
+    __u32   num_periods;    // 0: as many as fit in the pool buffer
+};
+
+struct udma_ring_status {
+    __u64   periods;        // periods filled since the start, written by the driver
+    __u64   consumed;       // periods userspace is done with, written by userspace
+    __u64   overruns;       // periods refilled before they were consumed
+    __u32   head;           // period the engine is filling now (periods % num_periods)
+    __u32   num_periods;
+    __u32   period_len;
+    __u32   reserved[7];    // pads each channel's slot to a cache line
+};
+
+/* UDMA_IOC_SET_BUSY_POLL: for up to this many microseconds, blocking
+ * transfers on this file (read(), write(), UDMA_IOC_XFER) spin waiting for
+ * completion before sleeping.  0 turns it off; the busy_poll_us module
+ * parameter sets the starting value.  Channels count transfers that
+ * completed while spinning and ones that fell back to sleeping, reported
+ * by UDMA_IOC_CHAN_INFO.  Meant for threads on otherwise idle cores.
+ */
+#define UDMA_BUSY_POLL_MAX_US   (10000)
+
+/* UDMA_IOC_EXPORT: export a pool (UDMA_XFER_POOL) or huge
+ * (UDMA_XFER_HUGE) buffer as a dma-buf, so that other drivers can import
+ * the same memory (V4L2, DRM, ...).  Returns the new fd, which is also
+ * written to fd.  CPU access to a cached buffer through the dma-buf goes
+ * between DMA_BUF_IOCTL_SYNC START and END, as with any other dma-buf.
+ * The buffer outlives the uio device as long as the fd does.
+ */
+struct udma_export {
+    __u32   handle;     // in: buffer index
+    __u32   flags;      // in: UDMA_XFER_POOL or UDMA_XFER_HUGE
+    __s32   fd;         // out
+    __u32   reserved;
+};
+
+#define UDMA_IOC_MAGIC          (0xDA)
+
+#define UDMA_IOC_REGISTER       _IOWR(UDMA_IOC_MAGIC, 0x00, struct udma_region)
+#define UDMA_IOC_UNREGISTER     _IOW(UDMA_IOC_MAGIC,  0x01, __u32)
+#define UDMA_IOC_XFER           _IOW(UDMA_IOC_MAGIC,  0x02, struct udma_xfer)
+#define UDMA_IOC_SUBMIT         _IOW(UDMA_IOC_MAGIC,  0x03, struct udma_xfer)
+#define UDMA_IOC_REAP           _IOW(UDMA_IOC_MAGIC,  0x04, struct udma_reap)
+#define UDMA_IOC_CHAN_INFO      _IOWR(UDMA_IOC_MAGIC, 0x05, struct udma_chan_info)
+#define UDMA_IOC_SET_CHAN       _IOW(UDMA_IOC_MAGIC,  0x06, struct udma_chan_sel)
+#define UDMA_IOC_CYCLIC_START   _IOW(UDMA_IOC_MAGIC,  0x07, struct udma_cyclic)
+#define UDMA_IOC_CYCLIC_STOP    _IO(UDMA_IOC_MAGIC,   0x08)
+#define UDMA_IOC_SET_BUSY_POLL  _IOW(UDMA_IOC_MAGIC,  0x09, __u32)
+#define UDMA_IOC_SUBMIT_BATCH   _IOW(UDMA_IOC_MAGIC,  0x0A, struct udma_batch)
+#define UDMA_IOC_EXPORT         _IOWR(UDMA_IOC_MAGIC, 0x0B, struct udma_export)
+#define UDMA_IOC_IMPORT         _IOWR(UDMA_IOC_MAGIC, 0x0C, struct udma_import)
+#define UDMA_IOC_SYNC           _IOW(UDMA_IOC_MAGIC,  0x0D, struct udma_sync)
+
+#endif /* _UDMA_IOCTL_H_ */
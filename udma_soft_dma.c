@@ -0,0 +1,859 @@
+/*
+ * udma_soft_dma -- a memcpy-backed dmaengine slave provider standing in for
+ * the AXI DMA, so that uio_pdrv_genirq + udma can be probed, exercised and
+ * benchmarked on any Linux box or in QEMU, without the FPGA.
+ *
+ * Channels come in TX/RX pairs, numbered 2n (TX) and 2n+1 (RX).  With
+ * loopback (the default) what is written to a TX channel lands in its RX
+ * channel; each TX descriptor is one packet, so an RX descriptor finishes
+ * short, with a residue, when the packet ends.  Without loopback TX is a
+ * sink and RX a source of a counting byte pattern.  Either way a channel
+ * moves bandwidth_mbps and takes latency_us for every descriptor (or cyclic
+ * period) it completes.
+ *
+ * Buffers are reached through phys_to_virt() of their DMA addresses, so the
+ * client's DMA has to be 1:1 with lowmem: no IOMMU, no bounce buffers.
+ *
+ * Describe it in the device tree (see udma-soft-dma-overlay.dts), or load
+ * with standalone=1 to get the provider plus a "uio_pdrv_genirq" client
+ * whose "dma-names" are loop0_tx, loop0_rx, loop1_tx, ..., matched up
+ * through a dma_slave_map.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <linux/module.h>
+#include <linux/device.h>
+#include <linux/platform_device.h>
+#include <linux/property.h>
+#include <linux/of.h>
+#include <linux/of_dma.h>
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/slab.h>
+#include <linux/sizes.h>
+#include <linux/spinlock.h>
+#include <linux/scatterlist.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
+#include <linux/uio_driver.h>
+#include <asm/io.h>
+
+#include <linux/dmaengine.h>
+#include <linux/dma-mapping.h>
+
+#define SOFT_DMA_NAME       "udma-soft-dma"
+#define SOFT_DMA_CLIENT     "uio_pdrv_genirq"
+#define SOFT_DMA_MAX_PAIRS  (16)
+
+static unsigned int num_pairs = 1;
+module_param(num_pairs, uint, S_IRUGO);
+MODULE_PARM_DESC(num_pairs, "TX/RX channel pairs per device, \"udma,pairs\" overrides it (default 1)");
+
+static unsigned int bandwidth_mbps;
+module_param(bandwidth_mbps, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(bandwidth_mbps, "Bytes each channel moves per microsecond, i.e. MB/s (default 0, as fast as memcpy)");
+
+static unsigned int latency_us;
+module_param(latency_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(latency_us, "Time each completed descriptor or cyclic period costs on top (default 0)");
+
+static bool loopback = true;
+module_param(loopback, bool, S_IRUGO);
+MODULE_PARM_DESC(loopback, "Feed each TX channel into its RX channel, rather than sink TX and generate RX (default Y)");
+
+static bool standalone;
+module_param(standalone, bool, S_IRUGO);
+MODULE_PARM_DESC(standalone, "Create the provider and a uio_pdrv_genirq client device without a device tree (default N)");
+
+struct soft_dma_seg
+{
+    dma_addr_t addr;
+    size_t len;
+};
+
+struct soft_dma_desc
+{
+    struct dma_async_tx_descriptor tx;
+    struct list_head node;
+    size_t len;                 // bytes in all of segs
+    size_t done;                // bytes moved so far; for cyclic, into the current lap
+    size_t period_len;          // cyclic only, else 0
+    unsigned int seg;           // where the next byte goes: segs[seg], seg_off bytes in
+    size_t seg_off;
+    unsigned int nsegs;
+    struct soft_dma_seg segs[];
+};
+
+struct soft_dma_pair;
+
+struct soft_dma_chan
+{
+    struct dma_chan chan;
+    struct soft_dma_pair * pair;
+    struct soft_dma_chan * peer;
+    enum dma_transfer_direction dir;
+
+    struct list_head submitted;     // tx_submit()ted, not issued yet
+    struct list_head active;        // issued; the first one is in progress
+
+    // The engine: the next step's size, and when it is done.
+    struct work_struct work;
+    struct hrtimer timer;
+    bool planned;
+    size_t step;
+    ktime_t due;
+    u8 pattern;                     // next byte the RX source produces
+};
+
+struct soft_dma_pair
+{
+    spinlock_t lock;                // both channels' lists and engines
+    struct soft_dma_chan tx;
+    struct soft_dma_chan rx;
+};
+
+struct soft_dma_dev
+{
+    struct dma_device dma;
+    struct device_dma_parameters dma_parms;
+    unsigned int num_pairs;
+    struct soft_dma_pair pairs[];
+};
+
+// What to call back once the pair's lock is dropped.
+struct soft_dma_cb
+{
+    dma_async_tx_callback callback;
+    dma_async_tx_callback_result callback_result;
+    void * param;
+    struct dmaengine_result result;
+};
+
+static struct platform_device * soft_dma_pdev;
+static struct platform_device * soft_dma_client;
+
+static inline struct soft_dma_chan * to_soft_chan( struct dma_chan * chan )
+{
+    return container_of( chan, struct soft_dma_chan, chan );
+}
+
+static inline struct soft_dma_desc * to_soft_desc( struct dma_async_tx_descriptor * tx )
+{
+    return container_of( tx, struct soft_dma_desc, tx );
+}
+
+// The channel whose engine moves sc's data: with loopback, RX is fed by its TX.
+static inline struct soft_dma_chan * soft_dma_engine( struct soft_dma_chan * sc )
+{
+    return loopback && sc->dir == DMA_DEV_TO_MEM ? sc->peer : sc;
+}
+
+static inline struct soft_dma_desc * soft_dma_head( struct soft_dma_chan * sc )
+{
+    return list_first_entry_or_null( &sc->active, struct soft_dma_desc, node );
+}
+
+// Bytes until d completes, or until the end of its current period.
+static inline size_t soft_dma_left( struct soft_dma_desc * d )
+{
+    if ( d->period_len )
+        return d->period_len - d->done % d->period_len;
+    return d->len - d->done;
+}
+
+// Address of d's next byte, with *len cut down to what is contiguous there.
+static void * soft_dma_run( struct soft_dma_desc * d, size_t * len )
+{
+    struct soft_dma_seg * s = &d->segs[d->seg];
+
+    *len = min( *len, s->len - d->seg_off );
+    return phys_to_virt( (phys_addr_t)s->addr ) + d->seg_off;
+}
+
+static void soft_dma_advance( struct soft_dma_desc * d, size_t len )
+{
+    d->done += len;
+    d->seg_off += len;
+    if ( d->seg_off == d->segs[d->seg].len )
+    {
+        d->seg_off = 0;
+        if ( ++d->seg == d->nsegs )
+            d->seg = 0;
+    }
+}
+
+static void soft_dma_cb_save( struct soft_dma_cb * cb, struct soft_dma_desc * d )
+{
+    cb->callback = d->tx.callback;
+    cb->callback_result = d->tx.callback_result;
+    cb->param = d->tx.callback_param;
+    cb->result.result = DMA_TRANS_NOERROR;
+    cb->result.residue = d->period_len ? 0 : d->len - d->done;
+}
+
+static void soft_dma_cb_invoke( struct soft_dma_cb * cb )
+{
+    if ( cb->callback_result )
+        cb->callback_result( cb->param, &cb->result );
+    else if ( cb->callback )
+        cb->callback( cb->param );
+}
+
+/* d has moved its bytes for this step: retire it if it is finished, or just
+ * report the period if it is cyclic.  end says the packet feeding it ended.
+ * Returns the number of callbacks added to cbs.
+ */
+static unsigned int soft_dma_retire( struct soft_dma_chan * sc, struct soft_dma_desc * d, bool end,
+                                     struct soft_dma_cb * cbs, struct list_head * done )
+{
+    if ( d->period_len )
+    {
+        if ( d->done % d->period_len )
+            return 0;
+        if ( d->done == d->len )
+            d->done = 0;
+    }
+    else
+    {
+        if ( d->done < d->len && !end )
+            return 0;
+        sc->chan.completed_cookie = d->tx.cookie;
+        list_move_tail( &d->node, done );
+    }
+
+    soft_dma_cb_save( cbs, d );
+    return 1;
+}
+
+// How many bytes the next step on sc's engine moves; 0 if it has nothing to do.
+static size_t soft_dma_plan( struct soft_dma_chan * sc )
+{
+    struct soft_dma_desc * d = soft_dma_head( sc );
+    struct soft_dma_desc * r;
+    size_t n;
+
+    if ( !d )
+        return 0;
+    n = soft_dma_left( d );
+
+    if ( loopback )
+    {
+        if ( sc->dir != DMA_MEM_TO_DEV )
+            return 0;
+        if ( !(r = soft_dma_head( sc->peer )) )
+            return 0;   // hold the packet until there is somewhere to put it
+        n = min( n, soft_dma_left( r ) );
+    }
+
+    return n;
+}
+
+static u64 soft_dma_cost( size_t n, bool cyclic )
+{
+    u64 ns = (u64)latency_us * NSEC_PER_USEC;
+
+    if ( bandwidth_mbps )
+        ns += div_u64( (u64)n * NSEC_PER_USEC, bandwidth_mbps );
+
+    // A free-running cyclic source must still give the work a break.
+    if ( cyclic && ns < NSEC_PER_USEC )
+        ns = NSEC_PER_USEC;
+
+    return ns;
+}
+
+// Carry out the planned step of n bytes.  Called with the pair's lock held.
+static unsigned int soft_dma_step( struct soft_dma_chan * sc, size_t n,
+                                   struct soft_dma_cb * cbs, struct list_head * done )
+{
+    struct soft_dma_desc * d = soft_dma_head( sc );
+    struct soft_dma_desc * r = NULL;
+    unsigned int ncbs = 0;
+    size_t left = n;
+    bool end;
+
+    if ( loopback && sc->dir == DMA_MEM_TO_DEV )
+        r = soft_dma_head( sc->peer );
+
+    while ( left )
+    {
+        size_t len = left;
+
+        if ( sc->dir == DMA_MEM_TO_DEV )
+        {
+            void * src = soft_dma_run( d, &len );
+
+            if ( r )
+            {
+                memcpy( soft_dma_run( r, &len ), src, len );
+                soft_dma_advance( r, len );
+            }
+        }
+        else
+        {
+            u8 * dst = soft_dma_run( d, &len );
+            size_t i;
+
+            for ( i = 0; i < len; ++i )
+                dst[i] = sc->pattern++;
+        }
+
+        soft_dma_advance( d, len );
+        left -= len;
+    }
+
+    end = sc->dir == DMA_MEM_TO_DEV && d->done == d->len;
+    ncbs += soft_dma_retire( sc, d, false, &cbs[ncbs], done );
+    if ( r )
+        ncbs += soft_dma_retire( sc->peer, r, end, &cbs[ncbs], done );
+
+    return ncbs;
+}
+
+static void soft_dma_free_list( struct list_head * head )
+{
+    struct soft_dma_desc * d, * tmp;
+
+    list_for_each_entry_safe( d, tmp, head, node )
+    {
+        list_del( &d->node );
+        kfree( d );
+    }
+}
+
+static void soft_dma_work( struct work_struct * work )
+{
+    struct soft_dma_chan * sc = container_of( work, struct soft_dma_chan, work );
+    struct soft_dma_pair * pair = sc->pair;
+    struct soft_dma_cb cbs[2];
+    unsigned int ncbs, i;
+    bool chained = false;
+    unsigned long flags;
+    ktime_t now;
+
+    for ( ;; )
+    {
+        LIST_HEAD( done );
+
+        spin_lock_irqsave( &pair->lock, flags );
+        now = ktime_get();
+
+        if ( !sc->planned )
+        {
+            struct soft_dma_desc * d;
+
+            if ( !(sc->step = soft_dma_plan( sc )) )
+            {
+                spin_unlock_irqrestore( &pair->lock, flags );
+                break;
+            }
+            d = soft_dma_head( sc );
+
+            // Back to back steps follow on from the last one, not from when the work got to run.
+            sc->due = ktime_add_ns( chained ? sc->due : now,
+                                    soft_dma_cost( sc->step, d->period_len != 0 ) );
+            sc->planned = true;
+        }
+
+        if ( ktime_before( now, sc->due ) )
+        {
+            hrtimer_start( &sc->timer, sc->due, HRTIMER_MODE_ABS );
+            spin_unlock_irqrestore( &pair->lock, flags );
+            break;
+        }
+
+        sc->planned = false;
+        ncbs = soft_dma_step( sc, sc->step, cbs, &done );
+        spin_unlock_irqrestore( &pair->lock, flags );
+
+        for ( i = 0; i < ncbs; ++i )
+            soft_dma_cb_invoke( &cbs[i] );
+        soft_dma_free_list( &done );
+
+        chained = true;
+        cond_resched();
+    }
+}
+
+static enum hrtimer_restart soft_dma_timer_func( struct hrtimer * timer )
+{
+    struct soft_dma_chan * sc = container_of( timer, struct soft_dma_chan, timer );
+
+    queue_work( system_highpri_wq, &sc->work );
+    return HRTIMER_NORESTART;
+}
+
+static dma_cookie_t soft_dma_tx_submit( struct dma_async_tx_descriptor * tx )
+{
+    struct soft_dma_chan * sc = to_soft_chan( tx->chan );
+    struct soft_dma_desc * d = to_soft_desc( tx );
+    unsigned long flags;
+    dma_cookie_t cookie;
+
+    spin_lock_irqsave( &sc->pair->lock, flags );
+    cookie = sc->chan.cookie + 1;
+    if ( cookie < DMA_MIN_COOKIE )
+        cookie = DMA_MIN_COOKIE;
+    sc->chan.cookie = tx->cookie = cookie;
+    list_add_tail( &d->node, &sc->submitted );
+    spin_unlock_irqrestore( &sc->pair->lock, flags );
+
+    return cookie;
+}
+
+static struct soft_dma_desc * soft_dma_desc_alloc( struct soft_dma_chan * sc, unsigned int nsegs,
+                                                  unsigned long flags )
+{
+    struct soft_dma_desc * d;
+
+    d = kzalloc( sizeof(*d) + nsegs * sizeof(d->segs[0]), GFP_NOWAIT );
+    if ( !d )
+        return NULL;
+
+    dma_async_tx_descriptor_init( &d->tx, &sc->chan );
+    d->tx.flags = flags;
+    d->tx.tx_submit = soft_dma_tx_submit;
+    INIT_LIST_HEAD( &d->node );
+
+    return d;
+}
+
+static struct dma_async_tx_descriptor * soft_dma_prep_slave_sg( struct dma_chan * chan,
+        struct scatterlist * sgl, unsigned int sg_len,
+        enum dma_transfer_direction dir, unsigned long flags, void * context )
+{
+    struct soft_dma_chan * sc = to_soft_chan( chan );
+    struct soft_dma_desc * d;
+    struct scatterlist * sg;
+    unsigned int i;
+
+    if ( dir != sc->dir || !sg_len )
+        return NULL;
+
+    if ( !(d = soft_dma_desc_alloc( sc, sg_len, flags )) )
+        return NULL;
+
+    for_each_sg( sgl, sg, sg_len, i )
+    {
+        if ( !sg_dma_len( sg ) )
+            continue;
+        d->segs[d->nsegs].addr = sg_dma_address( sg );
+        d->segs[d->nsegs].len = sg_dma_len( sg );
+        d->len += sg_dma_len( sg );
+        d->nsegs++;
+    }
+
+    if ( !d->len )
+    {
+        kfree( d );
+        return NULL;
+    }
+
+    return &d->tx;
+}
+
+static struct dma_async_tx_descriptor * soft_dma_prep_dma_cyclic( struct dma_chan * chan,
+        dma_addr_t buf_addr, size_t buf_len, size_t period_len,
+        enum dma_transfer_direction dir, unsigned long flags )
+{
+    struct soft_dma_chan * sc = to_soft_chan( chan );
+    struct soft_dma_desc * d;
+
+    if ( dir != sc->dir || !period_len || !buf_len || buf_len % period_len )
+        return NULL;
+
+    if ( !(d = soft_dma_desc_alloc( sc, 1, flags )) )
+        return NULL;
+
+    d->segs[0].addr = buf_addr;
+    d->segs[0].len = buf_len;
+    d->nsegs = 1;
+    d->len = buf_len;
+    d->period_len = period_len;
+
+    return &d->tx;
+}
+
+static void soft_dma_issue_pending( struct dma_chan * chan )
+{
+    struct soft_dma_chan * sc = to_soft_chan( chan );
+    unsigned long flags;
+
+    spin_lock_irqsave( &sc->pair->lock, flags );
+    list_splice_tail_init( &sc->submitted, &sc->active );
+    spin_unlock_irqrestore( &sc->pair->lock, flags );
+
+    queue_work( system_highpri_wq, &soft_dma_engine( sc )->work );
+}
+
+static enum dma_status soft_dma_tx_status( struct dma_chan * chan, dma_cookie_t cookie,
+                                           struct dma_tx_state * state )
+{
+    struct soft_dma_chan * sc = to_soft_chan( chan );
+    struct soft_dma_desc * d;
+    dma_cookie_t last, used;
+    enum dma_status ret;
+    unsigned long flags;
+    u32 residue = 0;
+
+    spin_lock_irqsave( &sc->pair->lock, flags );
+    last = chan->completed_cookie;
+    used = chan->cookie;
+    ret = dma_async_is_complete( cookie, last, used );
+
+    if ( ret != DMA_COMPLETE )
+    {
+        list_for_each_entry( d, &sc->active, node )
+        {
+            if ( d->tx.cookie == cookie )
+            {
+                residue = d->len - d->done;
+                goto found;
+            }
+        }
+        list_for_each_entry( d, &sc->submitted, node )
+        {
+            if ( d->tx.cookie == cookie )
+            {
+                residue = d->len;
+                break;
+            }
+        }
+    }
+
+    found:
+    spin_unlock_irqrestore( &sc->pair->lock, flags );
+
+    dma_set_tx_state( state, last, used, residue );
+    return ret;
+}
+
+static int soft_dma_config( struct dma_chan * chan, struct dma_slave_config * config )
+{
+    return 0;   // nothing to configure: there is no device end
+}
+
+static int soft_dma_terminate_all( struct dma_chan * chan )
+{
+    struct soft_dma_chan * sc = to_soft_chan( chan );
+    unsigned long flags;
+    LIST_HEAD( head );
+
+    spin_lock_irqsave( &sc->pair->lock, flags );
+    list_splice_tail_init( &sc->active, &head );
+    list_splice_tail_init( &sc->submitted, &head );
+    // A planned step may have been sized for one of these; plan it again.
+    sc->pair->tx.planned = false;
+    sc->pair->rx.planned = false;
+    spin_unlock_irqrestore( &sc->pair->lock, flags );
+
+    soft_dma_free_list( &head );
+    return 0;
+}
+
+// Callbacks for either channel of a pair can be running on either engine.
+static void soft_dma_synchronize( struct dma_chan * chan )
+{
+    struct soft_dma_chan * sc = to_soft_chan( chan );
+
+    flush_work( &sc->pair->tx.work );
+    flush_work( &sc->pair->rx.work );
+}
+
+static int soft_dma_alloc_chan_resources( struct dma_chan * chan )
+{
+    return 0;
+}
+
+static void soft_dma_free_chan_resources( struct dma_chan * chan )
+{
+    soft_dma_terminate_all( chan );
+    soft_dma_synchronize( chan );
+}
+
+static struct dma_chan * soft_dma_chan_at( struct soft_dma_dev * sd, unsigned int index )
+{
+    struct soft_dma_pair * pair = &sd->pairs[index / 2];
+
+    return index & 1 ? &pair->rx.chan : &pair->tx.chan;
+}
+
+static struct dma_chan * soft_dma_of_xlate( struct of_phandle_args * spec, struct of_dma * ofdma )
+{
+    struct soft_dma_dev * sd = ofdma->of_dma_data;
+
+    if ( spec->args_count != 1 || spec->args[0] >= 2 * sd->num_pairs )
+        return NULL;
+
+    return dma_get_slave_channel( soft_dma_chan_at( sd, spec->args[0] ) );
+}
+
+static bool soft_dma_filter( struct dma_chan * chan, void * param )
+{
+    return chan == param;
+}
+
+static void soft_dma_chan_init( struct soft_dma_dev * sd, struct soft_dma_pair * pair,
+                                struct soft_dma_chan * sc, enum dma_transfer_direction dir )
+{
+    sc->pair = pair;
+    sc->peer = sc == &pair->tx ? &pair->rx : &pair->tx;
+    sc->dir = dir;
+    INIT_LIST_HEAD( &sc->submitted );
+    INIT_LIST_HEAD( &sc->active );
+    INIT_WORK( &sc->work, soft_dma_work );
+    hrtimer_init( &sc->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS );
+    sc->timer.function = soft_dma_timer_func;
+
+    sc->chan.device = &sd->dma;
+    list_add_tail( &sc->chan.device_node, &sd->dma.channels );
+}
+
+/* Without a device tree, clients find their channels by name through a
+ * slave map: the standalone client's "dma-names" are loop<n>_tx/_rx.
+ */
+static int soft_dma_map_init( struct soft_dma_dev * sd, struct device * dev )
+{
+    struct dma_slave_map * map;
+    unsigned int i;
+
+    map = devm_kcalloc( dev, 2 * sd->num_pairs, sizeof(*map), GFP_KERNEL );
+    if ( !map )
+        return -ENOMEM;
+
+    for ( i = 0; i < 2 * sd->num_pairs; ++i )
+    {
+        map[i].devname = SOFT_DMA_CLIENT;
+        map[i].slave = devm_kasprintf( dev, GFP_KERNEL, "loop%u_%s", i / 2, i & 1 ? "rx" : "tx" );
+        if ( !map[i].slave )
+            return -ENOMEM;
+        map[i].param = soft_dma_chan_at( sd, i );
+    }
+
+    sd->dma.filter.map = map;
+    sd->dma.filter.mapcnt = 2 * sd->num_pairs;
+    sd->dma.filter.fn = soft_dma_filter;
+
+    return 0;
+}
+
+static int soft_dma_probe( struct platform_device * pdev )
+{
+    struct device_node * np = pdev->dev.of_node;
+    struct soft_dma_dev * sd;
+    struct dma_device * dma;
+    u32 pairs = num_pairs;
+    unsigned int i;
+    int rv;
+
+    device_property_read_u32( &pdev->dev, "udma,pairs", &pairs );
+    pairs = clamp_t( u32, pairs, 1, SOFT_DMA_MAX_PAIRS );
+
+    sd = devm_kzalloc( &pdev->dev, sizeof(*sd) + pairs * sizeof(sd->pairs[0]), GFP_KERNEL );
+    if ( !sd )
+        return -ENOMEM;
+    sd->num_pairs = pairs;
+
+    // udma splits its scatterlists at this, so keep it out of the way.
+    pdev->dev.dma_parms = &sd->dma_parms;
+    dma_set_max_seg_size( &pdev->dev, SZ_1G );
+
+    dma = &sd->dma;
+    dma->dev = &pdev->dev;
+    INIT_LIST_HEAD( &dma->channels );
+    dma_cap_set( DMA_SLAVE, dma->cap_mask );
+    dma_cap_set( DMA_CYCLIC, dma->cap_mask );
+    dma_cap_set( DMA_PRIVATE, dma->cap_mask );
+    dma->directions = BIT(DMA_DEV_TO_MEM) | BIT(DMA_MEM_TO_DEV);
+    dma->src_addr_widths = BIT(DMA_SLAVE_BUSWIDTH_4_BYTES) | BIT(DMA_SLAVE_BUSWIDTH_8_BYTES);
+    dma->dst_addr_widths = dma->src_addr_widths;
+    dma->residue_granularity = DMA_RESIDUE_GRANULARITY_BURST;
+
+    dma->device_alloc_chan_resources = soft_dma_alloc_chan_resources;
+    dma->device_free_chan_resources = soft_dma_free_chan_resources;
+    dma->device_prep_slave_sg = soft_dma_prep_slave_sg;
+    dma->device_prep_dma_cyclic = soft_dma_prep_dma_cyclic;
+    dma->device_config = soft_dma_config;
+    dma->device_terminate_all = soft_dma_terminate_all;
+    dma->device_synchronize = soft_dma_synchronize;
+    dma->device_tx_status = soft_dma_tx_status;
+    dma->device_issue_pending = soft_dma_issue_pending;
+
+    for ( i = 0; i < pairs; ++i )
+    {
+        struct soft_dma_pair * pair = &sd->pairs[i];
+
+        spin_lock_init( &pair->lock );
+        soft_dma_chan_init( sd, pair, &pair->tx, DMA_MEM_TO_DEV );
+        soft_dma_chan_init( sd, pair, &pair->rx, DMA_DEV_TO_MEM );
+    }
+
+    if ( !np && (rv = soft_dma_map_init( sd, &pdev->dev )) )
+        return rv;
+
+    if ( (rv = dma_async_device_register( dma )) )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": dma_async_device_register() failed: %d\n", rv );
+        return rv;
+    }
+
+    if ( np && (rv = of_dma_controller_register( np, soft_dma_of_xlate, sd )) )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": of_dma_controller_register() failed: %d\n", rv );
+        dma_async_device_unregister( dma );
+        return rv;
+    }
+
+    platform_set_drvdata( pdev, sd );
+
+    printk( KERN_INFO KBUILD_MODNAME ": %s: %u channel pairs, %s, %u MB/s, %u us per descriptor\n",
+            dev_name( &pdev->dev ), pairs, loopback ? "loopback" : "sink/source",
+            bandwidth_mbps, latency_us );
+
+    return 0;
+}
+
+static int soft_dma_remove( struct platform_device * pdev )
+{
+    struct soft_dma_dev * sd = platform_get_drvdata( pdev );
+    unsigned int i;
+
+    if ( pdev->dev.of_node )
+        of_dma_controller_free( pdev->dev.of_node );
+    dma_async_device_unregister( &sd->dma );
+
+    for ( i = 0; i < sd->num_pairs; ++i )
+    {
+        hrtimer_cancel( &sd->pairs[i].tx.timer );
+        hrtimer_cancel( &sd->pairs[i].rx.timer );
+        cancel_work_sync( &sd->pairs[i].tx.work );
+        cancel_work_sync( &sd->pairs[i].rx.work );
+    }
+
+    return 0;
+}
+
+static const struct of_device_id soft_dma_of_match[] = {
+    { .compatible = "udma,soft-dma" },
+    { /* Sentinel */ },
+};
+MODULE_DEVICE_TABLE(of, soft_dma_of_match);
+
+static struct platform_driver soft_dma_driver = {
+    .probe = soft_dma_probe,
+    .remove = soft_dma_remove,
+    .driver = {
+        .name = SOFT_DMA_NAME,
+        .of_match_table = of_match_ptr(soft_dma_of_match),
+    },
+};
+
+static struct uio_info soft_dma_uioinfo = {
+    .name = "udma-soft",
+    .version = "soft-dma",
+    .irq = UIO_IRQ_NONE,
+};
+
+// The standalone provider, and a uio_pdrv_genirq device using all its channels.
+static int soft_dma_standalone_add( void )
+{
+    struct property_entry props[2] = { };
+    const char ** names;
+    unsigned int i, n = 2 * clamp( num_pairs, 1u, (unsigned int)SOFT_DMA_MAX_PAIRS );
+    int rv = -ENOMEM;
+
+    soft_dma_pdev = platform_device_register_simple( SOFT_DMA_NAME, PLATFORM_DEVID_NONE, NULL, 0 );
+    if ( IS_ERR( soft_dma_pdev ) )
+    {
+        rv = PTR_ERR( soft_dma_pdev );
+        soft_dma_pdev = NULL;
+        return rv;
+    }
+
+    names = kcalloc( n, sizeof(*names), GFP_KERNEL );
+    if ( !names )
+        goto err_pdev;
+    for ( i = 0; i < n; ++i )
+    {
+        if ( !(names[i] = kasprintf( GFP_KERNEL, "loop%u_%s", i / 2, i & 1 ? "rx" : "tx" )) )
+            goto err_names;
+    }
+    props[0] = (struct property_entry)PROPERTY_ENTRY_STRING_ARRAY_LEN( "dma-names", names, n );
+
+    soft_dma_client = platform_device_alloc( SOFT_DMA_CLIENT, PLATFORM_DEVID_NONE );
+    if ( !soft_dma_client )
+        goto err_names;
+
+    soft_dma_client->dev.coherent_dma_mask = DMA_BIT_MASK(64);
+    soft_dma_client->dev.dma_mask = &soft_dma_client->dev.coherent_dma_mask;
+
+    // Both copy what they are given.
+    if ( (rv = platform_device_add_data( soft_dma_client, &soft_dma_uioinfo, sizeof(soft_dma_uioinfo) )) )
+        goto err_client;
+    if ( (rv = platform_device_add_properties( soft_dma_client, props )) )
+        goto err_client;
+    if ( (rv = platform_device_add( soft_dma_client )) )
+        goto err_client;
+
+    for ( i = 0; i < n; ++i )
+        kfree( names[i] );
+    kfree( names );
+    return 0;
+
+    err_client:
+    platform_device_put( soft_dma_client );
+    soft_dma_client = NULL;
+
+    err_names:
+    for ( i = 0; i < n; ++i )
+        kfree( names[i] );
+    kfree( names );
+
+    err_pdev:
+    platform_device_unregister( soft_dma_pdev );
+    soft_dma_pdev = NULL;
+    return rv;
+}
+
+static int __init soft_dma_init( void )
+{
+    int rv;
+
+    if ( (rv = platform_driver_register( &soft_dma_driver )) )
+        return rv;
+
+    if ( standalone && (rv = soft_dma_standalone_add()) )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": couldn't create the standalone devices: %d\n", rv );
+        platform_driver_unregister( &soft_dma_driver );
+    }
+
+    return rv;
+}
+
+static void __exit soft_dma_exit( void )
+{
+    if ( soft_dma_client )
+        platform_device_unregister( soft_dma_client );
+    if ( soft_dma_pdev )
+        platform_device_unregister( soft_dma_pdev );
+    platform_driver_unregister( &soft_dma_driver );
+}
+
+module_init(soft_dma_init);
+module_exit(soft_dma_exit);
+
+MODULE_DESCRIPTION("memcpy-backed dmaengine provider for running udma without the hardware");
+MODULE_LICENSE("GPL v2");
+MODULE_ALIAS("platform:" SOFT_DMA_NAME);
@@ -0,0 +1,162 @@
+/*
+ * udma tracepoints -- the stages a transfer goes through, for ftrace,
+ * perf and bpftrace.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM udma
+
+#if !defined(_UDMA_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _UDMA_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+/* Only udma.c includes this, after <linux/udma.h>; that has no include
+ * guard, so it can't be pulled in again from here.
+ */
+
+// read(), write() or their iter variants entered, before anything is pinned.
+TRACE_EVENT(udma_call,
+
+    TP_PROTO(struct udma_drvdata *p_info, size_t count),
+
+    TP_ARGS(p_info, count),
+
+    TP_STRUCT__entry(
+        __string(   chan,   p_info->name    )
+        __field(    u32,    dir             )
+        __field(    size_t, count           )
+    ),
+
+    TP_fast_assign(
+        __assign_str(chan, p_info->name);
+        __entry->dir = p_info->dir;
+        __entry->count = count;
+    ),
+
+    TP_printk("chan=%s dir=%s count=%zu",
+        __get_str(chan),
+        __entry->dir == UDMA_DEV_TO_CPU ? "rx" : "tx",
+        __entry->count)
+);
+
+DECLARE_EVENT_CLASS(udma_xfer,
+
+    TP_PROTO(struct udma_inflight_info *p_xfer),
+
+    TP_ARGS(p_xfer),
+
+    TP_STRUCT__entry(
+        __string(   chan,   p_xfer->p_info->name    )
+        __field(    const void *, xfer              )
+        __field(    int,    cookie                  )
+        __field(    size_t, len                     )
+        __field(    int,    nents                   )
+    ),
+
+    TP_fast_assign(
+        __assign_str(chan, p_xfer->p_info->name);
+        __entry->xfer = p_xfer;
+        __entry->cookie = p_xfer->cookie;
+        __entry->len = p_xfer->len;
+        __entry->nents = p_xfer->nents;
+    ),
+
+    TP_printk("chan=%s xfer=%p cookie=%d len=%zu nents=%d",
+        __get_str(chan), __entry->xfer, __entry->cookie,
+        __entry->len, __entry->nents)
+);
+
+// get_user_pages_fast() has pinned the user buffer.
+DEFINE_EVENT(udma_xfer, udma_pinned,
+    TP_PROTO(struct udma_inflight_info *p_xfer),
+    TP_ARGS(p_xfer)
+);
+
+// dma_map_sg() is done, or the slice of a registered buffer is built.
+DEFINE_EVENT(udma_xfer, udma_mapped,
+    TP_PROTO(struct udma_inflight_info *p_xfer),
+    TP_ARGS(p_xfer)
+);
+
+// dmaengine_submit() handed out the cookie.
+DEFINE_EVENT(udma_xfer, udma_submit,
+    TP_PROTO(struct udma_inflight_info *p_xfer),
+    TP_ARGS(p_xfer)
+);
+
+// A blocking caller is back from waiting for (or spinning on) the transfer.
+DEFINE_EVENT(udma_xfer, udma_wakeup,
+    TP_PROTO(struct udma_inflight_info *p_xfer),
+    TP_ARGS(p_xfer)
+);
+
+// udma_unprepare_after_dma() is about to unmap and unpin.
+DEFINE_EVENT(udma_xfer, udma_unprepare,
+    TP_PROTO(struct udma_inflight_info *p_xfer),
+    TP_ARGS(p_xfer)
+);
+
+DECLARE_EVENT_CLASS(udma_xfer_status,
+
+    TP_PROTO(struct udma_inflight_info *p_xfer, int status),
+
+    TP_ARGS(p_xfer, status),
+
+    TP_STRUCT__entry(
+        __string(   chan,   p_xfer->p_info->name    )
+        __field(    const void *, xfer              )
+        __field(    int,    cookie                  )
+        __field(    size_t, len                     )
+        __field(    int,    nents                   )
+        __field(    int,    status                  )
+    ),
+
+    TP_fast_assign(
+        __assign_str(chan, p_xfer->p_info->name);
+        __entry->xfer = p_xfer;
+        __entry->cookie = p_xfer->cookie;
+        __entry->len = p_xfer->len;
+        __entry->nents = p_xfer->nents;
+        __entry->status = status;
+    ),
+
+    TP_printk("chan=%s xfer=%p cookie=%d len=%zu nents=%d status=%d",
+        __get_str(chan), __entry->xfer, __entry->cookie,
+        __entry->len, __entry->nents, __entry->status)
+);
+
+// The dmaengine callback ran; len is what was actually transferred.
+DEFINE_EVENT(udma_xfer_status, udma_callback,
+    TP_PROTO(struct udma_inflight_info *p_xfer, int status),
+    TP_ARGS(p_xfer, status)
+);
+
+/* The transfer is done, whichever way: its own callback, another one's
+ * for the batch it was in, the batch timer, or an abort (-ECANCELED).
+ */
+DEFINE_EVENT(udma_xfer_status, udma_complete,
+    TP_PROTO(struct udma_inflight_info *p_xfer, int status),
+    TP_ARGS(p_xfer, status)
+);
+
+#endif /* _UDMA_TRACE_H_ */
+
+// udma.c builds with -I$(src) so that this directory is searched.
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE udma_trace
+#include <trace/define_trace.h>
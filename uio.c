@@ -71,6 +71,16 @@ static ssize_t map_offset_show(struct uio_mem *mem, char *buf)
 	return sprintf(buf, "0x%llx\n", (unsigned long long)mem->addr & ~PAGE_MASK);
 }
 
+static ssize_t map_dma_addr_show(struct uio_mem *mem, char *buf)
+{
+	dma_addr_t dma_addr;
+
+	if (udma_mem_dma_addr(mem, &dma_addr))
+		return -ENODEV;
+
+	return sprintf(buf, "%pad\n", &dma_addr);
+}
+
 struct map_sysfs_entry {
 	struct attribute attr;
 	ssize_t (*show)(struct uio_mem *, char *);
@@ -85,12 +95,15 @@ static struct map_sysfs_entry size_attribute =
 	__ATTR(size, S_IRUGO, map_size_show, NULL);
 static struct map_sysfs_entry offset_attribute =
 	__ATTR(offset, S_IRUGO, map_offset_show, NULL);
+static struct map_sysfs_entry dma_addr_attribute =
+	__ATTR(dma_addr, S_IRUGO, map_dma_addr_show, NULL);
 
 static struct attribute *attrs[] = {
 	&name_attribute.attr,
 	&addr_attribute.attr,
 	&size_attribute.attr,
 	&offset_attribute.attr,
+	&dma_addr_attribute.attr,
 	NULL,	/* need to NULL terminate the list of attributes */
 };
 
@@ -428,6 +441,7 @@ static irqreturn_t uio_interrupt(int irq, void *dev_id)
 struct uio_listener {
 	struct uio_device *dev;
 	s32 event_count;
+	struct udma_file *udma;
 };
 
 static int uio_open(struct inode *inode, struct file *filep)
@@ -459,6 +473,16 @@ static int uio_open(struct inode *inode, struct file *filep)
 	listener->event_count = atomic_read(&idev->event);
 	filep->private_data = listener;
 
+	listener->udma = udma_open(idev->info);
+	if (IS_ERR(listener->udma)) {
+		ret = PTR_ERR(listener->udma);
+		goto err_udma_open;
+	}
+#ifdef FMODE_NOWAIT
+	if (listener->udma)
+		filep->f_mode |= FMODE_NOWAIT;	/* udma honours IOCB_NOWAIT */
+#endif
+
 	if (idev->info->open) {
 		ret = idev->info->open(idev->info, inode);
 		if (ret)
@@ -467,6 +491,9 @@ static int uio_open(struct inode *inode, struct file *filep)
 	return 0;
 
 err_infoopen:
+	udma_release(listener->udma);
+
+err_udma_open:
 	kfree(listener);
 
 err_alloc_listener:
@@ -493,6 +520,8 @@ static int uio_release(struct inode *inode, struct file *filep)
 	if (idev->info->release)
 		ret = idev->info->release(idev->info, inode);
 
+	udma_release(listener->udma);
+
 	module_put(idev->owner);
 	kfree(listener);
 	return ret;
@@ -502,14 +531,18 @@ static unsigned int uio_poll(struct file *filep, poll_table *wait)
 {
 	struct uio_listener *listener = filep->private_data;
 	struct uio_device *idev = listener->dev;
+	unsigned int mask;
+
+	/* udma completions and free TX slots count too */
+	mask = udma_poll(listener->udma, filep, wait);
 
 	if (!idev->info->irq)
-		return -EIO;
+		return listener->udma ? mask : -EIO;
 
 	poll_wait(filep, &idev->wait, wait);
 	if (listener->event_count != atomic_read(&idev->event))
-		return POLLIN | POLLRDNORM;
-	return 0;
+		mask |= POLLIN | POLLRDNORM;
+	return mask;
 }
 
 static ssize_t uio_read(struct file *filep, char __user *buf,
@@ -521,8 +554,8 @@ static ssize_t uio_read(struct file *filep, char __user *buf,
 	ssize_t retval;
 	s32 event_count;
 
-	if (is_udma()) // for uio dma transaction.
-		return udma_read( filep , buf, count, ppos);
+	if (udma_file_has_chan(listener->udma, UDMA_DIR_RX)) // for uio dma transaction.
+		return udma_read(listener->udma, buf, count);
 
 	if (!idev->info->irq)
 		return -EIO;
@@ -573,8 +606,8 @@ static ssize_t uio_write(struct file *filep, const char __user *buf,
 	ssize_t retval;
 	s32 irq_on;
 
-	if (is_udma())  // for uio dma transaction
-		return udma_write( filep , buf, count, ppos);
+	if (udma_file_has_chan(listener->udma, UDMA_DIR_TX))  // for uio dma transaction
+		return udma_write(listener->udma, buf, count);
 
 	if (!idev->info->irq)
 		return -EIO;   
@@ -595,6 +628,55 @@ static ssize_t uio_write(struct file *filep, const char __user *buf,
 
 }
 
+/*
+ * readv()/writev(), aio and io_uring come in through the iter variants.
+ * udma moves all the segments as one transfer, or queues one transfer
+ * per segment with its vectored parameter cleared; plain uio only
+ * understands a single s32, so hand a lone segment to the old read/write
+ * path.
+ */
+static ssize_t uio_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct uio_listener *listener = iocb->ki_filp->private_data;
+	struct iovec iov;
+
+	if (udma_file_has_chan(listener->udma, UDMA_DIR_RX))
+		return udma_read_iter(listener->udma, iocb, to);
+
+	if (!iter_is_iovec(to) || to->nr_segs != 1)
+		return -EINVAL;
+
+	iov = iov_iter_iovec(to);
+	return uio_read(iocb->ki_filp, iov.iov_base, iov.iov_len,
+			&iocb->ki_pos);
+}
+
+static ssize_t uio_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct uio_listener *listener = iocb->ki_filp->private_data;
+	struct iovec iov;
+
+	if (udma_file_has_chan(listener->udma, UDMA_DIR_TX))
+		return udma_write_iter(listener->udma, iocb, from);
+
+	if (!iter_is_iovec(from) || from->nr_segs != 1)
+		return -EINVAL;
+
+	iov = iov_iter_iovec(from);
+	return uio_write(iocb->ki_filp, iov.iov_base, iov.iov_len,
+			 &iocb->ki_pos);
+}
+
+static long uio_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
+{
+	struct uio_listener *listener = filep->private_data;
+
+	if (!listener->udma)
+		return -ENOTTY;
+
+	return udma_ioctl(listener->udma, cmd, arg);
+}
+
 static int uio_find_mem_index(struct vm_area_struct *vma)
 {
 	struct uio_device *idev = vma->vm_private_data;
@@ -718,6 +800,8 @@ static int uio_mmap(struct file *filep, struct vm_area_struct *vma)
 		case UIO_MEM_LOGICAL:
 		case UIO_MEM_VIRTUAL:
 			return uio_mmap_logical(vma);
+		case UIO_MEM_UDMA:
+			return udma_mmap(idev->info->mem + mi, vma);
 		default:
 			return -EINVAL;
 	}
@@ -729,6 +813,9 @@ static const struct file_operations uio_fops = {
 	.release	= uio_release,
 	.read		= uio_read,
 	.write		= uio_write,
+	.read_iter	= uio_read_iter,
+	.write_iter	= uio_write_iter,
+	.unlocked_ioctl	= uio_ioctl,
 	.mmap		= uio_mmap,
 	.poll		= uio_poll,
 	.fasync		= uio_fasync,
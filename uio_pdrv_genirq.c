@@ -23,6 +23,7 @@
 #include <linux/stringify.h>
 #include <linux/pm_runtime.h>
 #include <linux/slab.h>
+#include <linux/property.h>
 
 #include <linux/of.h>
 #include <linux/of_platform.h>
@@ -150,7 +151,9 @@ static int uio_pdrv_genirq_probe(struct platform_device *pdev)
 	if (!uioinfo->irq) {
 		ret = platform_get_irq(pdev, 0);
 		uioinfo->irq = ret;
-		if (ret == -ENXIO && pdev->dev.of_node)
+		/* udma devices needn't have an interrupt of their own */
+		if (ret == -ENXIO && (pdev->dev.of_node ||
+				      device_property_present(&pdev->dev, "dma-names")))
 			uioinfo->irq = UIO_IRQ_NONE;
 		else if (ret < 0) {
 			dev_err(&pdev->dev, "failed to get IRQ\n");
@@ -207,21 +210,19 @@ static int uio_pdrv_genirq_probe(struct platform_device *pdev)
 	 */
 	pm_runtime_enable(&pdev->dev);
 
-	ret = uio_register_device(&pdev->dev, priv->uioinfo);
-	if (ret) {
-		dev_err(&pdev->dev, "unable to register uio device\n");
-		pm_runtime_disable(&pdev->dev);
-		return ret;
-	}
- 
-    // billy for udma
-    int dma_num = check_udma(pdev);
+    // billy for udma -- before registering, so pool buffers show up as uio maps
+    int dma_num = check_udma(pdev, uioinfo);
 
 	if (dma_num>0){
         printk( KERN_ALERT KBUILD_MODNAME ": %d dma channel(s) is(are) available\n",  dma_num );
 	}
 	else if (dma_num < 0) {
-        printk( KERN_ERR KBUILD_MODNAME ":have udma informations ,but fail to init!\n");
+		/* -EPROBE_DEFER: a DMA provider isn't there yet, come back once
+		 * it is.  Anything else: don't register a half set up device. */
+		if (dma_num != -EPROBE_DEFER)
+			printk( KERN_ERR KBUILD_MODNAME ":have udma informations ,but fail to init!\n");
+		pm_runtime_disable(&pdev->dev);
+		return dma_num;
 	}
     else  {  
     	printk( KERN_ALERT KBUILD_MODNAME ": no udma need to be init.\n" );
@@ -229,6 +230,14 @@ static int uio_pdrv_genirq_probe(struct platform_device *pdev)
 	}
     //
 
+	ret = uio_register_device(&pdev->dev, priv->uioinfo);
+	if (ret) {
+		dev_err(&pdev->dev, "unable to register uio device\n");
+		teardown_udma(pdev);
+		pm_runtime_disable(&pdev->dev);
+		return ret;
+	}
+
 	platform_set_drvdata(pdev, priv);
 
 	return 0;